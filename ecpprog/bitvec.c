@@ -0,0 +1,301 @@
+/*
+ * Moving bit vectors between bit offsets, with SSE2 and AVX2 versions of
+ * the inner loops. The vector width is picked once, at the first call.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "bitvec.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && defined(__SSE2__)
+#define BITVEC_X86 1
+#include <immintrin.h>
+#endif
+
+/* dst[i] = src[i] >> shift | src[i + 1] << (8 - shift) for i < bytes, with
+ * shift 1-7. Reads src[0] to src[bytes]. */
+typedef void (*bitvec_shift_t)(uint8_t *dst, const uint8_t *src, unsigned shift, size_t bytes);
+typedef long (*bitvec_mismatch_t)(const uint8_t *a, const uint8_t *b, const uint8_t *mask, size_t bytes);
+
+static void shift_scalar(uint8_t *dst, const uint8_t *src, unsigned shift, size_t bytes)
+{
+	for (size_t i = 0; i < bytes; i++)
+		dst[i] = src[i] >> shift | src[i + 1] << (8 - shift);
+}
+
+/* The same for MSB first bytes: dst[i] = src[i] << shift | src[i + 1] >> (8 - shift) */
+static void shift_msb_scalar(uint8_t *dst, const uint8_t *src, unsigned shift, size_t bytes)
+{
+	for (size_t i = 0; i < bytes; i++)
+		dst[i] = src[i] << shift | src[i + 1] >> (8 - shift);
+}
+
+static long mismatch_scalar(const uint8_t *a, const uint8_t *b, const uint8_t *mask, size_t bytes)
+{
+	for (size_t i = 0; i < bytes; i++)
+		if ((a[i] ^ b[i]) & mask[i])
+			return i;
+	return -1;
+}
+
+#ifdef BITVEC_X86
+
+/* There are no byte shifts: shift 16 bit lanes, and mask off the bits that
+ * crossed into the neighbouring byte. */
+static void shift_sse2(uint8_t *dst, const uint8_t *src, unsigned shift, size_t bytes)
+{
+	const __m128i low = _mm_set1_epi8((char)(0xff >> shift));
+	const __m128i high = _mm_set1_epi8((char)(0xff << (8 - shift)));
+	const __m128i right = _mm_cvtsi32_si128(shift);
+	const __m128i left = _mm_cvtsi32_si128(8 - shift);
+	size_t i = 0;
+
+	for (; i + 16 <= bytes; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i + 1));
+		__m128i v = _mm_or_si128(
+			_mm_and_si128(_mm_srl_epi16(a, right), low),
+			_mm_and_si128(_mm_sll_epi16(b, left), high));
+		_mm_storeu_si128((__m128i *)(dst + i), v);
+	}
+
+	shift_scalar(dst + i, src + i, shift, bytes - i);
+}
+
+static void shift_msb_sse2(uint8_t *dst, const uint8_t *src, unsigned shift, size_t bytes)
+{
+	const __m128i high = _mm_set1_epi8((char)(0xff << shift));
+	const __m128i low = _mm_set1_epi8((char)(0xff >> (8 - shift)));
+	const __m128i left = _mm_cvtsi32_si128(shift);
+	const __m128i right = _mm_cvtsi32_si128(8 - shift);
+	size_t i = 0;
+
+	for (; i + 16 <= bytes; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i + 1));
+		__m128i v = _mm_or_si128(
+			_mm_and_si128(_mm_sll_epi16(a, left), high),
+			_mm_and_si128(_mm_srl_epi16(b, right), low));
+		_mm_storeu_si128((__m128i *)(dst + i), v);
+	}
+
+	shift_msb_scalar(dst + i, src + i, shift, bytes - i);
+}
+
+static long mismatch_sse2(const uint8_t *a, const uint8_t *b, const uint8_t *mask, size_t bytes)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+
+	for (; i + 16 <= bytes; i += 16) {
+		__m128i x = _mm_xor_si128(
+			_mm_loadu_si128((const __m128i *)(a + i)),
+			_mm_loadu_si128((const __m128i *)(b + i)));
+		x = _mm_and_si128(x, _mm_loadu_si128((const __m128i *)(mask + i)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, zero)) != 0xffff)
+			break;
+	}
+
+	long rest = mismatch_scalar(a + i, b + i, mask + i, bytes - i);
+	return rest < 0 ? -1 : (long)i + rest;
+}
+
+__attribute__((target("avx2")))
+static void shift_avx2(uint8_t *dst, const uint8_t *src, unsigned shift, size_t bytes)
+{
+	const __m256i low = _mm256_set1_epi8((char)(0xff >> shift));
+	const __m256i high = _mm256_set1_epi8((char)(0xff << (8 - shift)));
+	const __m128i right = _mm_cvtsi32_si128(shift);
+	const __m128i left = _mm_cvtsi32_si128(8 - shift);
+	size_t i = 0;
+
+	for (; i + 32 <= bytes; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 1));
+		__m256i v = _mm256_or_si256(
+			_mm256_and_si256(_mm256_srl_epi16(a, right), low),
+			_mm256_and_si256(_mm256_sll_epi16(b, left), high));
+		_mm256_storeu_si256((__m256i *)(dst + i), v);
+	}
+
+	/* The tail runs SSE code: avoid the AVX to SSE transition penalty */
+	_mm256_zeroupper();
+	shift_sse2(dst + i, src + i, shift, bytes - i);
+}
+
+__attribute__((target("avx2")))
+static void shift_msb_avx2(uint8_t *dst, const uint8_t *src, unsigned shift, size_t bytes)
+{
+	const __m256i high = _mm256_set1_epi8((char)(0xff << shift));
+	const __m256i low = _mm256_set1_epi8((char)(0xff >> (8 - shift)));
+	const __m128i left = _mm_cvtsi32_si128(shift);
+	const __m128i right = _mm_cvtsi32_si128(8 - shift);
+	size_t i = 0;
+
+	for (; i + 32 <= bytes; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 1));
+		__m256i v = _mm256_or_si256(
+			_mm256_and_si256(_mm256_sll_epi16(a, left), high),
+			_mm256_and_si256(_mm256_srl_epi16(b, right), low));
+		_mm256_storeu_si256((__m256i *)(dst + i), v);
+	}
+
+	_mm256_zeroupper();
+	shift_msb_sse2(dst + i, src + i, shift, bytes - i);
+}
+
+__attribute__((target("avx2")))
+static long mismatch_avx2(const uint8_t *a, const uint8_t *b, const uint8_t *mask, size_t bytes)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i = 0;
+
+	for (; i + 32 <= bytes; i += 32) {
+		__m256i x = _mm256_xor_si256(
+			_mm256_loadu_si256((const __m256i *)(a + i)),
+			_mm256_loadu_si256((const __m256i *)(b + i)));
+		x = _mm256_and_si256(x, _mm256_loadu_si256((const __m256i *)(mask + i)));
+		if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, zero)) != 0xffffffff)
+			break;
+	}
+
+	_mm256_zeroupper();
+	long rest = mismatch_sse2(a + i, b + i, mask + i, bytes - i);
+	return rest < 0 ? -1 : (long)i + rest;
+}
+
+#endif
+
+static bool bitvec_ready;
+static enum bitvec_isa bitvec_isa;
+static bitvec_shift_t bitvec_shift;
+static bitvec_shift_t bitvec_shift_msb;
+static bitvec_mismatch_t bitvec_compare;
+
+static enum bitvec_isa bitvec_detect(void)
+{
+#ifdef BITVEC_X86
+	if (__builtin_cpu_supports("avx2"))
+		return BITVEC_AVX2;
+	return BITVEC_SSE2;
+#else
+	return BITVEC_SCALAR;
+#endif
+}
+
+static void bitvec_use(enum bitvec_isa isa)
+{
+	bitvec_isa = isa;
+	bitvec_shift = shift_scalar;
+	bitvec_shift_msb = shift_msb_scalar;
+	bitvec_compare = mismatch_scalar;
+#ifdef BITVEC_X86
+	if (isa == BITVEC_SSE2) {
+		bitvec_shift = shift_sse2;
+		bitvec_shift_msb = shift_msb_sse2;
+		bitvec_compare = mismatch_sse2;
+	} else if (isa == BITVEC_AVX2) {
+		bitvec_shift = shift_avx2;
+		bitvec_shift_msb = shift_msb_avx2;
+		bitvec_compare = mismatch_avx2;
+	}
+#endif
+	bitvec_ready = true;
+}
+
+/* main() calls bitvec_get_isa() before it starts any threads */
+static inline void bitvec_init(void)
+{
+	if (!bitvec_ready)
+		bitvec_use(bitvec_detect());
+}
+
+enum bitvec_isa bitvec_get_isa(void)
+{
+	bitvec_init();
+	return bitvec_isa;
+}
+
+void bitvec_limit_isa(enum bitvec_isa isa)
+{
+	enum bitvec_isa best = bitvec_detect();
+	bitvec_use(isa < best ? isa : best);
+}
+
+const char *bitvec_isa_name(enum bitvec_isa isa)
+{
+	switch (isa) {
+	case BITVEC_SSE2:
+		return "SSE2";
+	case BITVEC_AVX2:
+		return "AVX2";
+	default:
+		return "scalar";
+	}
+}
+
+/* The odd bits at either end, one at a time. Bit i is bit i % 8 of its
+ * byte, or with msb bit 7 - i % 8. */
+static void copy_slow(uint8_t *dst, uint32_t dst_offset, const uint8_t *src, uint32_t src_offset, uint32_t count, bool msb)
+{
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t d = dst_offset + i, s = src_offset + i;
+		unsigned d_bit = msb ? 7 - d % 8 : d % 8;
+		unsigned s_bit = msb ? 7 - s % 8 : s % 8;
+		if ((src[s / 8] >> s_bit) & 1)
+			dst[d / 8] |= 1 << d_bit;
+		else
+			dst[d / 8] &= ~(1 << d_bit);
+	}
+}
+
+static void copy_bits(uint8_t *dst, uint32_t dst_offset, const uint8_t *src, uint32_t src_offset, uint32_t count, bool msb)
+{
+	bitvec_init();
+
+	dst += dst_offset / 8;
+	dst_offset %= 8;
+	src += src_offset / 8;
+	src_offset %= 8;
+
+	/* Bring the destination to a byte boundary */
+	if (dst_offset != 0) {
+		uint32_t head = 8 - dst_offset;
+		if (head > count)
+			head = count;
+		copy_slow(dst, dst_offset, src, src_offset, head, msb);
+		count -= head;
+		dst++;
+		src += (src_offset + head) / 8;
+		src_offset = (src_offset + head) % 8;
+	}
+
+	/* Whole destination bytes, then what is left of the last one */
+	size_t bytes = count / 8;
+	if (src_offset == 0)
+		memcpy(dst, src, bytes);
+	else if (bytes > 0)
+		(msb ? bitvec_shift_msb : bitvec_shift)(dst, src, src_offset, bytes);
+
+	copy_slow(dst + bytes, 0, src + bytes, src_offset, count % 8, msb);
+}
+
+void bitvec_copy(uint8_t *dst, uint32_t dst_offset, const uint8_t *src, uint32_t src_offset, uint32_t count)
+{
+	copy_bits(dst, dst_offset, src, src_offset, count, false);
+}
+
+void bitvec_copy_msb(uint8_t *dst, uint32_t dst_offset, const uint8_t *src, uint32_t src_offset, uint32_t count)
+{
+	copy_bits(dst, dst_offset, src, src_offset, count, true);
+}
+
+long bitvec_mismatch(const uint8_t *a, const uint8_t *b, const uint8_t *mask, size_t bytes)
+{
+	bitvec_init();
+	return bitvec_compare(a, b, mask, bytes);
+}
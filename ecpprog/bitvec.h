@@ -0,0 +1,50 @@
+/*
+ * Bit vectors the way the JTAG layer and the SVF player keep them: bit 0 is
+ * the LSB of byte 0, the first bit shifted out on TDI or in from TDO.
+ *
+ * Scans in a chain or an SVF file are rarely byte aligned, so their payload
+ * has to be moved between bit offsets on the way in and out. These helpers
+ * do that a vector at a time, with SSE2 or AVX2 when the CPU has it, and
+ * fall back to plain C elsewhere.
+ */
+
+#ifndef __BITVEC_H__
+#define __BITVEC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum bitvec_isa {
+	BITVEC_SCALAR = 0,
+	BITVEC_SSE2   = 1,
+	BITVEC_AVX2   = 2,
+};
+
+/**
+ * Copies count bits from src, starting at bit src_offset, to dst starting at
+ * bit dst_offset. Bits of dst outside the range are left alone. The buffers
+ * must not overlap.
+ */
+void bitvec_copy(uint8_t *dst, uint32_t dst_offset, const uint8_t *src, uint32_t src_offset, uint32_t count);
+
+/**
+ * bitvec_copy() for bytes that are shifted MSB first, like SPI data: bit 0
+ * is the MSB of byte 0.
+ */
+void bitvec_copy_msb(uint8_t *dst, uint32_t dst_offset, const uint8_t *src, uint32_t src_offset, uint32_t count);
+
+/**
+ * Returns the index of the first byte where a and b differ in a bit that is
+ * set in mask, or -1 if there is none.
+ */
+long bitvec_mismatch(const uint8_t *a, const uint8_t *b, const uint8_t *mask, size_t bytes);
+
+/**
+ * The instruction set in use, the best the CPU supports unless limited by
+ * bitvec_limit_isa(), which is meant for benchmarks and tests.
+ */
+enum bitvec_isa bitvec_get_isa(void);
+void bitvec_limit_isa(enum bitvec_isa isa);
+const char *bitvec_isa_name(enum bitvec_isa isa);
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ *  bitvec_bench -- timing of the bit vector helpers for every instruction
+ *  set the CPU supports, on the shapes of data ecpprog moves around.
+ *
+ *  Each result is also checked against a one bit at a time copy.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bitvec.h"
+
+#define MAX_BYTES (1 << 20)
+
+struct shape {
+	const char *name;
+	uint32_t dst_offset;
+	uint32_t src_offset;
+	uint32_t bits;
+	int rounds;
+	bool msb;
+};
+
+static const struct shape shapes[] = {
+	/* A page program folded in behind three BYPASS bits */
+	{ "page fold",     3,  0, (4 + 256) * 8,     20000, false },
+	/* A bulk flash read extracted from behind a chain, MSB first */
+	{ "read extract",  0,  5, 64 * 1024 * 8,       200, true },
+	/* A full bitstream, as a single SVF SDR */
+	{ "svf sdr",       1,  7, MAX_BYTES * 8 - 9,    10, false },
+	/* Short scans with odd lengths */
+	{ "short odd",     6,  3, 37,               500000, false },
+};
+
+static uint8_t src[MAX_BYTES + 1];
+static uint8_t dst[MAX_BYTES + 1];
+static uint8_t ref[MAX_BYTES + 1];
+static uint8_t mask[MAX_BYTES + 1];
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void copy_ref(uint8_t *d, uint32_t dst_offset, const uint8_t *s, uint32_t src_offset, uint32_t count, bool msb)
+{
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t di = dst_offset + i, si = src_offset + i;
+		unsigned d_bit = msb ? 7 - di % 8 : di % 8;
+		unsigned s_bit = msb ? 7 - si % 8 : si % 8;
+		if ((s[si / 8] >> s_bit) & 1)
+			d[di / 8] |= 1 << d_bit;
+		else
+			d[di / 8] &= ~(1 << d_bit);
+	}
+}
+
+static void copy(const struct shape *s)
+{
+	if (s->msb)
+		bitvec_copy_msb(dst, s->dst_offset, src, s->src_offset, s->bits);
+	else
+		bitvec_copy(dst, s->dst_offset, src, s->src_offset, s->bits);
+}
+
+static int check_copy(const struct shape *s)
+{
+	memset(dst, 0x5a, sizeof(dst));
+	memset(ref, 0x5a, sizeof(ref));
+	copy(s);
+	copy_ref(ref, s->dst_offset, src, s->src_offset, s->bits, s->msb);
+	return memcmp(dst, ref, sizeof(dst)) == 0;
+}
+
+static void bench_copy(const struct shape *s)
+{
+	if (!check_copy(s)) {
+		printf("  %-14s MISMATCH\n", s->name);
+		exit(1);
+	}
+
+	double start = now();
+	for (int i = 0; i < s->rounds; i++)
+		copy(s);
+	double t = now() - start;
+
+	double mb = (double)s->bits / 8 * s->rounds / (1024 * 1024);
+	printf("  %-14s %9.1f MiB/s\n", s->name, mb / t);
+}
+
+static void bench_mismatch(void)
+{
+	const size_t bytes = MAX_BYTES;
+	const int rounds = 200;
+
+	memcpy(dst, src, bytes);
+	dst[bytes - 3] ^= 0x10;
+	memset(mask, 0xff, bytes);
+	mask[bytes - 3] = 0xef;
+
+	if (bitvec_mismatch(src, dst, mask, bytes) != -1) {
+		printf("  %-14s MISMATCH\n", "tdo compare");
+		exit(1);
+	}
+	mask[bytes - 3] = 0xff;
+	if (bitvec_mismatch(src, dst, mask, bytes) != (long)bytes - 3) {
+		printf("  %-14s MISMATCH\n", "tdo compare");
+		exit(1);
+	}
+
+	mask[bytes - 3] = 0xef;
+	double start = now();
+	for (int i = 0; i < rounds; i++)
+		if (bitvec_mismatch(src, dst, mask, bytes) != -1)
+			exit(1);
+	double t = now() - start;
+
+	double mb = (double)bytes * rounds / (1024 * 1024);
+	printf("  %-14s %9.1f MiB/s\n", "tdo compare", mb / t);
+}
+
+int main(void)
+{
+	srand(1);
+	for (size_t i = 0; i < sizeof(src); i++)
+		src[i] = rand();
+
+	enum bitvec_isa best = bitvec_get_isa();
+
+	for (int isa = BITVEC_SCALAR; isa <= (int)best; isa++) {
+		bitvec_limit_isa(isa);
+		printf("%s:\n", bitvec_isa_name(isa));
+
+		for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++)
+			bench_copy(&shapes[i]);
+		bench_mismatch();
+	}
+
+	return 0;
+}
@@ -34,16 +34,21 @@
 #include <string.h>
 #include <getopt.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
 #ifdef _WIN32
 #include <io.h> /* _setmode() */
 #include <fcntl.h> /* _O_BINARY */
 #endif
 
+#include "mpsse.h"
 #include "jtag.h"
 #include "lattice_cmds.h"
+#include "svf.h"
+#include "bitvec.h"
 
 static bool verbose = false;
 
@@ -59,8 +64,6 @@ struct device_info {
 	enum device_type type;
 };
 
-static struct device_info connected_device = {0};
-
 
 // ---------------------------------------------------------
 // FLASH definitions
@@ -108,60 +111,76 @@ enum flash_cmd {
 };
 
 
+/* Operations flash_wait() waits for, each with its own learned duration */
+enum flash_op {
+	FLASH_OP_PROGRAM,
+	FLASH_OP_ERASE_4K,
+	FLASH_OP_ERASE_32K,
+	FLASH_OP_ERASE_64K,
+	FLASH_OP_ERASE_CHIP,
+	FLASH_OP_WRITE_STATUS,
+	FLASH_OPS
+};
+
+/* Typical durations in us, starting out at common datasheet values and
+ * then following what the attached flash actually takes. Gang workers
+ * each drive their own flash, so each thread learns its own. */
+static __thread unsigned flash_typical_us[FLASH_OPS] = {
+	[FLASH_OP_PROGRAM]      = 700,
+	[FLASH_OP_ERASE_4K]     = 45000,
+	[FLASH_OP_ERASE_32K]    = 120000,
+	[FLASH_OP_ERASE_64K]    = 150000,
+	[FLASH_OP_ERASE_CHIP]   = 2000000,
+	[FLASH_OP_WRITE_STATUS] = 5000,
+};
+
+/* What the attached flash is, from its SFDP tables (JESD216). Without them
+ * its size is unknown and the commands of the W25Q128JV are used. Like the
+ * durations, this is per thread: gang workers each have their own flash. */
+struct flash_info {
+	bool sfdp;
+	uint32_t size;                /* In bytes, 0 if unknown */
+	uint32_t page_size;
+	int address_bytes;            /* 4 only for flash that takes nothing else */
+	uint8_t erase_cmd[FLASH_OPS]; /* For the block erase ops, 0 if missing */
+	char fast_read[48];           /* The fast read modes, for the report */
+};
+
+static __thread struct flash_info flash_info = {
+	.page_size = 256,
+	.address_bytes = 3,
+	.erase_cmd = {
+		[FLASH_OP_ERASE_4K]  = FC_SE,
+		[FLASH_OP_ERASE_32K] = FC_BE32,
+		[FLASH_OP_ERASE_64K] = FC_BE64,
+	},
+};
+
+
 // ---------------------------------------------------------
 // JTAG -> SPI functions
 // ---------------------------------------------------------
 
-/* 
- * JTAG performrs all shifts LSB first, our FLSAH is expeting bytes MSB first,
- * There are a few ways to fix this, for now we just bit-reverse all the input data to the JTAG core
- */
-uint8_t bit_reverse(uint8_t in){
-
-	uint8_t out =  (in & 0x01) ? 0x80 : 0x00;
-	        out |= (in & 0x02) ? 0x40 : 0x00;
-	        out |= (in & 0x04) ? 0x20 : 0x00;
-	        out |= (in & 0x08) ? 0x10 : 0x00;
-	        out |= (in & 0x10) ? 0x08 : 0x00;
-	        out |= (in & 0x20) ? 0x04 : 0x00;
-	        out |= (in & 0x40) ? 0x02 : 0x00;
-	        out |= (in & 0x80) ? 0x01 : 0x00;
-
-	return out;
+/* SPI bytes go out MSB first, and so do the streams of the JTAG layer */
+int xfer_spi(struct jtag_ctx *jtag, uint8_t* data, uint32_t len){
+	/* Stays in SHIFT-DR if we're already there */
+	jtag_queue_stream(jtag, data, data, len * 8, true);
+	return jtag_flush(jtag);
 }
 
-void xfer_spi(uint8_t* data, uint32_t len){
-	/* Reverse bit order of all bytes */
-	for(int i = 0; i < len; i++){
-		data[i] = bit_reverse(data[i]);
-	}
-
-	/* Don't switch states if we're already in SHIFT-DR */
-	if(jtag_current_state() != STATE_SHIFT_DR)
-		jtag_go_to_state(STATE_SHIFT_DR);
-	jtag_tap_shift(data, data, len * 8, true);
-
-	/* Reverse bit order of all return bytes */
-	for(int i = 0; i < len; i++){
-		data[i] = bit_reverse(data[i]);
-	}
+/* Clocks in the reply to a command sent with queue_spi(), without sending
+ * anything in the meantime. */
+int recv_spi(struct jtag_ctx *jtag, uint8_t* data, uint32_t len){
+	jtag_queue_stream(jtag, NULL, data, len * 8, true);
+	return jtag_flush(jtag);
 }
 
-void send_spi(uint8_t* data, uint32_t len){
-	
-	/* Flip bit order of all bytes */
-	for(int i = 0; i < len; i++){
-		data[i] = bit_reverse(data[i]);
-	}
-
-	jtag_go_to_state(STATE_SHIFT_DR);
-	/* Stay in SHIFT-DR state, this keep CS low */
-	jtag_tap_shift(data, data, len * 8, false); 
-
-		/* Flip bit order of all bytes */
-	for(int i = 0; i < len; i++){
-		data[i] = bit_reverse(data[i]);
-	}
+/* Like xfer_spi(), for commands whose reply nobody looks at: the transfer is
+ * only queued, it goes out with the next one that waits for data, and no
+ * data comes back for it. With must_end false we stay in SHIFT-DR, which
+ * keeps CS low. */
+void queue_spi(struct jtag_ctx *jtag, const uint8_t* data, uint32_t len, bool must_end){
+	jtag_queue_stream(jtag, data, NULL, len * 8, must_end);
 }
 
 
@@ -169,7 +188,7 @@ void send_spi(uint8_t* data, uint32_t len){
 // FLASH function implementations
 // ---------------------------------------------------------
 
-static void flash_read_id()
+static void flash_read_id(struct jtag_ctx *jtag)
 {
 	/* JEDEC ID structure:
 	 * Byte No. | Data Type
@@ -188,7 +207,7 @@ static void flash_read_id()
 		fprintf(stderr, "read flash ID..\n");
 
 	// Write command and read first 4 bytes
-	xfer_spi(data, len);
+	xfer_spi(jtag, data, len);
 
 	fprintf(stderr, "flash ID:");
 	for (int i = 1; i < len; i++)
@@ -196,27 +215,181 @@ static void flash_read_id()
 	fprintf(stderr, "\n");
 }
 
-static void flash_reset()
+/* Reads len bytes of the SFDP tables at addr */
+static void flash_read_sfdp_data(struct jtag_ctx *jtag, uint32_t addr, uint8_t *data, int len)
+{
+	/* Always a 3 byte address, then 8 dummy clocks */
+	uint8_t command[5] = { FC_RSFDP, (uint8_t)(addr >> 16), (uint8_t)(addr >> 8), (uint8_t)addr, 0 };
+
+	queue_spi(jtag, command, 5, false);
+	recv_spi(jtag, data, len);
+}
+
+/* A typical time field of the BFPT: a count in the low 5 bits, the index
+ * into units above them */
+static unsigned sfdp_time_us(uint32_t field, const unsigned *units)
+{
+	return ((field & 0x1f) + 1) * units[field >> 5];
+}
+
+/* Fills in flash_info, and the typical durations flash_wait() starts out
+ * with, from the Basic Flash Parameter Table. Returns false, changing
+ * nothing, if the flash has no SFDP tables. */
+static bool flash_read_sfdp(struct jtag_ctx *jtag)
+{
+	/* The header, and the first parameter header, which is the BFPT's */
+	uint8_t header[16];
+	flash_read_sfdp_data(jtag, 0, header, sizeof(header));
+
+	if (memcmp(header, "SFDP", 4) != 0 || header[8] != 0x00 || header[15] != 0xFF || header[10] != 1 || header[11] < 9) {
+		if (verbose)
+			fprintf(stderr, "no SFDP tables\n");
+		return false;
+	}
+
+	/* JESD216 has 9 dwords, revision A and later 16 or more */
+	uint8_t table[16 * 4];
+	int dwords = header[11] < 16 ? header[11] : 16;
+	flash_read_sfdp_data(jtag, header[12] | header[13] << 8 | header[14] << 16, table, dwords * 4);
+
+	/* Numbered from 1, as in the standard */
+	uint32_t dw[17] = {0};
+	for (int i = 0; i < dwords; i++)
+		dw[i + 1] = table[4 * i] | table[4 * i + 1] << 8 | table[4 * i + 2] << 16 | (uint32_t)table[4 * i + 3] << 24;
+
+	struct flash_info info = { .sfdp = true, .page_size = 256, .address_bytes = 3 };
+
+	/* Density in bits */
+	if (dw[2] & 0x80000000) {
+		unsigned n = dw[2] & 0x7fffffff;
+		info.size = n < 3 ? 1 : n > 34 ? 0x80000000 : 1u << (n - 3);
+	} else {
+		info.size = dw[2] / 8 + 1;
+	}
+
+	/* Only the 4 byte only flash needs anything else than 3 byte addresses
+	 * to reach the first 16 MB */
+	if (((dw[1] >> 17) & 3) == 2)
+		info.address_bytes = 4;
+
+	snprintf(info.fast_read, sizeof(info.fast_read), "1-1-1%s%s%s%s%s%s",
+		dw[1] & (1 << 16) ? " 1-1-2" : "",
+		dw[1] & (1 << 20) ? " 1-2-2" : "",
+		dw[5] & (1 << 0) ? " 2-2-2" : "",
+		dw[1] & (1 << 22) ? " 1-1-4" : "",
+		dw[1] & (1 << 21) ? " 1-4-4" : "",
+		dw[5] & (1 << 4) ? " 4-4-4" : "");
+
+	/* Erase types 1-4, each a size exponent and an opcode */
+	static const unsigned erase_units[] = { 1000, 16000, 128000, 1000000 };
+	unsigned typical_us[FLASH_OPS] = {0};
+	bool erase_found = false;
+	for (int t = 0; t < 4; t++) {
+		uint32_t type = dw[8 + t / 2] >> (16 * (t % 2));
+		enum flash_op op;
+
+		switch (type & 0xff) {
+		case 12:
+			op = FLASH_OP_ERASE_4K;
+			break;
+		case 15:
+			op = FLASH_OP_ERASE_32K;
+			break;
+		case 16:
+			op = FLASH_OP_ERASE_64K;
+			break;
+		default:
+			continue;
+		}
+
+		info.erase_cmd[op] = type >> 8;
+		if (dwords >= 10)
+			typical_us[op] = sfdp_time_us((dw[10] >> (4 + 7 * t)) & 0x7f, erase_units);
+		erase_found = true;
+	}
+	if ((dw[1] & 3) == 1 && !info.erase_cmd[FLASH_OP_ERASE_4K]) {
+		info.erase_cmd[FLASH_OP_ERASE_4K] = dw[1] >> 8;
+		erase_found = true;
+	}
+	/* Nothing we know how to use: try the usual commands */
+	if (!erase_found)
+		memcpy(info.erase_cmd, flash_info.erase_cmd, sizeof(info.erase_cmd));
+
+	if (dwords >= 11) {
+		static const unsigned program_units[] = { 8, 64 };
+		static const unsigned chip_units[] = { 16000, 256000, 4000000, 64000000 };
+
+		info.page_size = 1 << ((dw[11] >> 4) & 0xf);
+		typical_us[FLASH_OP_PROGRAM] = sfdp_time_us((dw[11] >> 8) & 0x3f, program_units);
+		typical_us[FLASH_OP_ERASE_CHIP] = sfdp_time_us((dw[11] >> 24) & 0x7f, chip_units);
+	}
+
+	flash_info = info;
+	for (int op = 0; op < FLASH_OPS; op++)
+		if (typical_us[op])
+			flash_typical_us[op] = typical_us[op];
+
+	return true;
+}
+
+/* Reports what flash_read_sfdp() found */
+static void flash_print_info(void)
+{
+	if (!flash_info.sfdp)
+		return;
+
+	fprintf(stderr, "flash: %u kB, %u byte pages, erase", flash_info.size / 1024, flash_info.page_size);
+	if (flash_info.erase_cmd[FLASH_OP_ERASE_4K])
+		fprintf(stderr, " 4k");
+	if (flash_info.erase_cmd[FLASH_OP_ERASE_32K])
+		fprintf(stderr, " 32k");
+	if (flash_info.erase_cmd[FLASH_OP_ERASE_64K])
+		fprintf(stderr, " 64k");
+	fprintf(stderr, ", %d byte addresses\n", flash_info.address_bytes);
+
+	if (verbose) {
+		fprintf(stderr, "fast read: %s\n", flash_info.fast_read);
+		fprintf(stderr, "typical us: program %u, erase 4k %u, 32k %u, 64k %u, chip %u\n",
+			flash_typical_us[FLASH_OP_PROGRAM], flash_typical_us[FLASH_OP_ERASE_4K],
+			flash_typical_us[FLASH_OP_ERASE_32K], flash_typical_us[FLASH_OP_ERASE_64K],
+			flash_typical_us[FLASH_OP_ERASE_CHIP]);
+	}
+}
+
+/* Ends the session if [addr, addr + size) is not all on the flash. Without
+ * 4 byte addresses only the first 16 MB can be reached. */
+static void flash_check_range(struct jtag_ctx *jtag, long addr, long size)
+{
+	long end = 1L << 24;
+	if (flash_info.address_bytes == 4)
+		end = 0x80000000L;
+	if (flash_info.size != 0 && flash_info.size < end)
+		end = flash_info.size;
+
+	if (addr < 0 || size < 0 || addr + size > end) {
+		fprintf(stderr, "0x%06lX +0x%lX is beyond the end of the flash at 0x%06lX\n", addr, size, end);
+		jtag_error(jtag, 2);
+	}
+}
+
+static void flash_reset(struct jtag_ctx *jtag)
 {
 	uint8_t data[8] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
 
 	// This disables CRM is if it was enabled
-	jtag_go_to_state(STATE_SHIFT_DR);
-	jtag_tap_shift(data, data, 64, true);
+	jtag_queue_stream(jtag, data, NULL, 64, true);
 
 	// This disables QPI if it was enabled
-	jtag_go_to_state(STATE_SHIFT_DR);
-	jtag_tap_shift(data, data, 2, true);
+	jtag_queue_stream(jtag, data, NULL, 2, true);
 
 	// This issues a flash reset command
-	jtag_go_to_state(STATE_SHIFT_DR);
-	jtag_tap_shift(data, data, 8, true);
+	jtag_queue_stream(jtag, data, NULL, 8, true);
 }
 
-static uint8_t read_status_1(){
+static uint8_t read_status_1(struct jtag_ctx *jtag){
 	uint8_t data[2] = { FC_RSR1 };
 
-	xfer_spi(data, 2);
+	xfer_spi(jtag, data, 2);
 
 	if (verbose) {
 		fprintf(stderr, "SR1: 0x%02X\n", data[1]);
@@ -264,10 +437,10 @@ static uint8_t read_status_1(){
 	return data[1];
 }
 
-static uint8_t read_status_2(){
+static uint8_t read_status_2(struct jtag_ctx *jtag){
 	uint8_t data[2] = { FC_RSR2 };
 
-	xfer_spi(data, 2);
+	xfer_spi(jtag, data, 2);
 
 	if (verbose) {
 		fprintf(stderr, "SR2: 0x%02X\n", data[1]);
@@ -281,183 +454,428 @@ static uint8_t read_status_2(){
 	return data[1];
 }
 
-static uint8_t flash_read_status()
+static uint8_t flash_read_status(struct jtag_ctx *jtag)
 {
-	uint8_t ret = read_status_1();
-	read_status_2();
+	uint8_t ret = read_status_1(jtag);
+	read_status_2(jtag);
 
 	return ret;
 }
 
 
-static void flash_write_enable()
+static void flash_write_enable(struct jtag_ctx *jtag)
 {
 	if (verbose) {
 		fprintf(stderr, "status before enable:\n");
-		flash_read_status();
+		flash_read_status(jtag);
 	}
 
 	if (verbose)
 		fprintf(stderr, "write enable..\n");
 
 	uint8_t data[1] = { FC_WE };
-	xfer_spi(data, 1);
+	queue_spi(jtag, data, 1, true);
 
 	if (verbose) {
 		fprintf(stderr, "status after enable:\n");
-		flash_read_status();
+		flash_read_status(jtag);
 	}
 }
 
-static void flash_bulk_erase()
+/* Puts opcode and addr in command, with as many address bytes as the flash
+ * takes, and returns the length */
+static int flash_command(uint8_t *command, uint8_t opcode, uint32_t addr)
 {
-	fprintf(stderr, "bulk erase..\n");
-
-	uint8_t data[1] = { FC_CE };
-	xfer_spi(data, 1);
+	int n = 0;
+
+	command[n++] = opcode;
+	if (flash_info.address_bytes == 4)
+		command[n++] = addr >> 24;
+	command[n++] = addr >> 16;
+	command[n++] = addr >> 8;
+	command[n++] = addr;
+	return n;
 }
 
-static void flash_4kB_sector_erase(int addr)
+static void flash_bulk_erase(struct jtag_ctx *jtag)
 {
-	fprintf(stderr, "erase 4kB sector at 0x%06X..\n", addr);
-
-	uint8_t command[4] = { FC_SE, (uint8_t)(addr >> 16), (uint8_t)(addr >> 8), (uint8_t)addr };
+	fprintf(stderr, "bulk erase..\n");
 
-	xfer_spi(command, 4);
+	uint8_t data[1] = { FC_CE };
+	queue_spi(jtag, data, 1, true);
 }
 
-static void flash_32kB_sector_erase(int addr)
+static void flash_prog(struct jtag_ctx *jtag, int addr, const uint8_t *data, int n)
 {
-	fprintf(stderr, "erase 64kB sector at 0x%06X..\n", addr);
+	if (verbose)
+		fprintf(stderr, "prog 0x%06X +0x%03X..\n", addr, n);
 
-	uint8_t command[4] = { FC_BE32, (uint8_t)(addr >> 16), (uint8_t)(addr >> 8), (uint8_t)addr };
+	uint8_t command[5];
+	int len = flash_command(command, FC_PP, addr);
 
-	xfer_spi(command, 4);
+	queue_spi(jtag, command, len, false);
+	jtag_set_phase(jtag, JTAG_PHASE_BULK);
+	queue_spi(jtag, data, n, true);
+	jtag_set_phase(jtag, JTAG_PHASE_CONTROL);
+	
+	if (verbose)
+		for (int i = 0; i < n; i++)
+			fprintf(stderr, "%02x%c", data[i], i == n - 1 || i % 32 == 31 ? '\n' : ' ');
 }
 
-static void flash_64kB_sector_erase(int addr)
-{
-	fprintf(stderr, "erase 64kB sector at 0x%06X..\n", addr);
 
-	uint8_t command[4] = { FC_BE64, (uint8_t)(addr >> 16), (uint8_t)(addr >> 8), (uint8_t)addr };
-
-	xfer_spi(command, 4);
-}
-
-static void flash_prog(int addr, uint8_t *data, int n)
+/* Each chunk is a read command of its own: with other devices on the JTAG
+ * chain, data only comes back once the transfer has ended. */
+static void flash_read(struct jtag_ctx *jtag, int addr, uint8_t *data, int n)
 {
 	if (verbose)
-		fprintf(stderr, "prog 0x%06X +0x%03X..\n", addr, n);
+		fprintf(stderr, "Read 0x%06X +0x%03X..\n", addr, n);
 
-	uint8_t command[4] = { FC_PP, (uint8_t)(addr >> 16), (uint8_t)(addr >> 8), (uint8_t)addr };
+	uint8_t command[5];
+	int len = flash_command(command, FC_RD, addr);
+	queue_spi(jtag, command, len, false);
 
-	send_spi(command, 4);
-	xfer_spi(data, n);
+	jtag_set_phase(jtag, JTAG_PHASE_BULK);
+	recv_spi(jtag, data, n);
+	jtag_set_phase(jtag, JTAG_PHASE_CONTROL);
 	
 	if (verbose)
 		for (int i = 0; i < n; i++)
 			fprintf(stderr, "%02x%c", data[i], i == n - 1 || i % 32 == 31 ? '\n' : ' ');
 }
 
-
-static void flash_start_read(int addr)
+static double time_seconds(void)
 {
-	if (verbose)
-		fprintf(stderr, "Start Read 0x%06X\n", addr);
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
 
-	uint8_t command[4] = { FC_RD, (uint8_t)(addr >> 16), (uint8_t)(addr >> 8), (uint8_t)addr };
+#define FLASH_POLLS         8     /* Status reads per transfer */
+#define FLASH_POLL_MIN_US   10    /* Closest spacing of the reads */
+#define FLASH_POLL_MAX_US   10000 /* Widest spacing, keeps a transfer short */
+#define FLASH_HOST_WAIT_US  2000  /* Longer waits sleep on the host instead */
 
-	send_spi(command, 4);
+/* When to first poll for an operation of typical duration, and how far
+ * apart the polls are, in us. The first batch of flash_wait() covers 15/16
+ * to 17/16 of the typical duration. */
+static void flash_poll_schedule(unsigned typical, uint32_t *wait, uint32_t *step)
+{
+	*wait = typical - typical / 16;
+	*step = typical / (8 * FLASH_POLLS);
+	if (*step < FLASH_POLL_MIN_US)
+		*step = FLASH_POLL_MIN_US;
+	if (*step > FLASH_POLL_MAX_US)
+		*step = FLASH_POLL_MAX_US;
 }
 
-static void flash_continue_read(uint8_t *data, int n)
+/* Moves a typical duration towards one just measured */
+static unsigned flash_learn(unsigned typical, unsigned took)
 {
-	if (verbose)
-		fprintf(stderr, "Contiune Read +0x%03X..\n", n);
-
-	memset(data, 0, n);
-	send_spi(data, n);
-	
-	if (verbose)
-		for (int i = 0; i < n; i++)
-			fprintf(stderr, "%02x%c", data[i], i == n - 1 || i % 32 == 31 ? '\n' : ' ');
+	return (3 * typical + took) / 4;
 }
 
-static void flash_wait()
+/* Waits for the flash to finish op, which may still be queued. The status
+ * reads go out FLASH_POLLS at a time in one transfer, spaced by idle clocks,
+ * starting just before op is expected to be done. The first read with WIP
+ * clear ends the wait; when none does, the next batch is spread out wider. */
+static void flash_wait(struct jtag_ctx *jtag, enum flash_op op)
 {
+	unsigned typical = flash_typical_us[op];
+	uint32_t wait, step;
+	flash_poll_schedule(typical, &wait, &step);
+
 	if (verbose)
 		fprintf(stderr, "waiting..");
 
-	int count = 0;
+	double start = time_seconds();
+	int timeouts = 0;
 	while (1)
 	{
-		uint8_t data[2] = { FC_RSR1 };
+		/* Send op on its way before a long sleep */
+		if (wait > FLASH_HOST_WAIT_US) {
+			jtag_flush(jtag);
+			usleep(wait);
+			wait = 0;
+		}
 
-		xfer_spi(data, 2);
+		double batch = time_seconds() - start;
+		uint8_t status[FLASH_POLLS][2];
+		for (int i = 0; i < FLASH_POLLS; i++) {
+			/* CS is high outside of SHIFT-DR */
+			jtag_go_to_state(jtag, STATE_RUN_TEST_IDLE);
+			jtag_wait_time(jtag, i == 0 ? wait : step);
 
-		if ((data[1] & 0x01) == 0) {
-			if (count < 2) {
-				count++;
-				if (verbose) {
-					fprintf(stderr, "r");
-					fflush(stderr);
-				}
-			} else {
-				if (verbose) {
-					fprintf(stderr, "R");
-					fflush(stderr);
-				}
-				break;
+			status[i][0] = FC_RSR1;
+			status[i][1] = 0;
+			jtag_queue_stream(jtag, status[i], status[i], 16, true);
+		}
+
+		/* A lost status read is harmless, just ask again */
+		if (jtag_flush(jtag) != MPSSE_OK) {
+			if (++timeouts > 3) {
+				fprintf(stderr, "flash not responding.\n");
+				jtag_error(jtag, 2);
 			}
-		} else {
-			if (verbose) {
-				fprintf(stderr, ".");
-				fflush(stderr);
+			wait = 0;
+			continue;
+		}
+
+		for (int i = 0; i < FLASH_POLLS; i++) {
+			if ((status[i][1] & 0x01) == 0) {
+				unsigned took = batch * 1e6 + wait + i * step;
+				flash_typical_us[op] = flash_learn(typical, took);
+				if (verbose)
+					fprintf(stderr, "R after %u us\n", took);
+				return;
 			}
-			count = 0;
 		}
 
-		usleep(1000);
-	}
+		if (verbose) {
+			fprintf(stderr, ".");
+			fflush(stderr);
+		}
 
-	if (verbose)
-		fprintf(stderr, "\n");
+		wait = step;
+		step *= 2;
+		if (step > FLASH_POLL_MAX_US)
+			step = FLASH_POLL_MAX_US;
+	}
+}
 
+/* Programs one page as a single transaction: write enable, the page program
+ * and the first batch of status reads are all queued and sent together. */
+static void flash_prog_page(struct jtag_ctx *jtag, int addr, const uint8_t *data, int n)
+{
+	flash_write_enable(jtag);
+	flash_prog(jtag, addr, data, n);
+	flash_wait(jtag, FLASH_OP_PROGRAM);
 }
 
-static void flash_disable_protection()
+static void flash_disable_protection(struct jtag_ctx *jtag)
 {
 	fprintf(stderr, "disable flash protection...\n");
 
 	// Write Status Register 1 <- 0x00
 	uint8_t data[2] = { FC_WSR1, 0x00 };
-	xfer_spi(data, 2);
+	queue_spi(jtag, data, 2, true);
 	
-	flash_wait();
+	flash_wait(jtag, FLASH_OP_WRITE_STATUS);
 	
 	// Read Status Register 1
 	data[0] = FC_RSR1;
 
-	xfer_spi(data, 2);
+	xfer_spi(jtag, data, 2);
 
 	if (data[1] != 0x00)
 		fprintf(stderr, "failed to disable protection, SR now equal to 0x%02x (expected 0x00)\n", data[1]);
 
 }
 
+static enum flash_op flash_erase_op(int erase_block_size)
+{
+	switch(erase_block_size) {
+		case 4:
+			return FLASH_OP_ERASE_4K;
+		case 32:
+			return FLASH_OP_ERASE_32K;
+		default:
+			return FLASH_OP_ERASE_64K;
+	}
+}
+
+/* One erase of a plan: op, a block erase or the chip erase, at addr */
+struct erase_step {
+	enum flash_op op;
+	uint32_t addr;
+};
+
+/* What a step costs on top of the erase itself: the command and the
+ * status polls around it */
+#define FLASH_ERASE_STEP_US 1000
+
+static uint32_t flash_erase_bytes(enum flash_op op)
+{
+	switch (op) {
+		case FLASH_OP_ERASE_4K:
+			return 4 << 10;
+		case FLASH_OP_ERASE_32K:
+			return 32 << 10;
+		case FLASH_OP_ERASE_64K:
+			return 64 << 10;
+		default:
+			return flash_info.size;
+	}
+}
+
+/* Starts the erase of step */
+static void flash_erase_start(struct jtag_ctx *jtag, const struct erase_step *step)
+{
+	if (step->op == FLASH_OP_ERASE_CHIP) {
+		flash_bulk_erase(jtag);
+		return;
+	}
+
+	fprintf(stderr, "erase %ukB sector at 0x%06X..\n", flash_erase_bytes(step->op) >> 10, step->addr);
+
+	uint8_t command[5];
+	int len = flash_command(command, flash_info.erase_cmd[step->op], step->addr);
+
+	queue_spi(jtag, command, len, true);
+}
+
+/* The erase block size in kB to use for -i: the one asked for if the flash
+ * has it, or else the largest it has */
+static int flash_erase_size(int requested)
+{
+	static const int sizes[] = { 64, 32, 4 };
+
+	if (flash_info.erase_cmd[flash_erase_op(requested)])
+		return requested;
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		if (flash_info.erase_cmd[flash_erase_op(sizes[i])]) {
+			fprintf(stderr, "flash has no %d kB erase, using %d kB\n", requested, sizes[i]);
+			return sizes[i];
+		}
+	}
+	return 64;
+}
+
+/* Plans the erase of [addr, addr + size) as the mix of block erases, or the
+ * chip erase, that takes the least time going by flash_typical_us. Nothing
+ * outside the range is erased but for what rounding it out to the smallest
+ * erase block takes, unless outside allows whole blocks, or the chip, around
+ * it when that is quicker. With erase_block_size (-i) set, only blocks of
+ * that many kB are used, covering the range as they come.
+ * Returns the number of steps, in a malloc()ed array at *plan. */
+static int flash_plan_erase(struct jtag_ctx *jtag, uint32_t addr, uint32_t size, int erase_block_size, bool outside, struct erase_step **plan)
+{
+	static const enum flash_op block_ops[] = { FLASH_OP_ERASE_4K, FLASH_OP_ERASE_32K, FLASH_OP_ERASE_64K };
+	enum flash_op ops[3];
+	int op_count = 0;
+
+	*plan = NULL;
+	if (size == 0)
+		return 0;
+
+	if (erase_block_size != 0) {
+		ops[op_count++] = flash_erase_op(flash_erase_size(erase_block_size));
+		outside = true;
+	} else {
+		for (int i = 0; i < 3; i++)
+			if (flash_info.erase_cmd[block_ops[i]])
+				ops[op_count++] = block_ops[i];
+	}
+
+	/* ops is in order of size. Any step starts on a multiple of unit, and
+	 * with outside the plan may cover whole blocks of the largest size. */
+	uint32_t unit = flash_erase_bytes(ops[0]);
+	uint32_t align = outside ? flash_erase_bytes(ops[op_count - 1]) : unit;
+	uint32_t begin = addr & ~(unit - 1);
+	uint32_t end = (addr + size + unit - 1) & ~(unit - 1);
+	uint32_t lo = addr & ~(align - 1);
+	uint32_t hi = (addr + size + align - 1) & ~(align - 1);
+	uint32_t units = (hi - lo) / unit;
+
+	/* cost[i]: the least time in us to erase what is left of the range
+	 * from unit i on, with the step starting there in choice[i] (-1: none,
+	 * the unit is outside the range) */
+	uint64_t *cost = malloc((units + 1) * sizeof(*cost));
+	int *choice = malloc(units * sizeof(*choice));
+	if (cost == NULL || choice == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		jtag_error(jtag, 1);
+	}
+
+	cost[units] = 0;
+	for (uint32_t i = units; i-- > 0; ) {
+		uint32_t at = lo + i * unit;
+
+		cost[i] = UINT64_MAX;
+		if (at < begin || at >= end) {
+			cost[i] = cost[i + 1];
+			choice[i] = -1;
+		}
+		for (int k = 0; k < op_count; k++) {
+			uint32_t bytes = flash_erase_bytes(ops[k]);
+			if (at % bytes != 0 || at + bytes > hi)
+				continue;
+
+			uint64_t c = flash_typical_us[ops[k]] + FLASH_ERASE_STEP_US + cost[i + bytes / unit];
+			if (c < cost[i]) {
+				cost[i] = c;
+				choice[i] = k;
+			}
+		}
+	}
+
+	/* The chip erase, where the range is all of the flash or it may be */
+	uint64_t chip_cost = flash_typical_us[FLASH_OP_ERASE_CHIP] + FLASH_ERASE_STEP_US;
+	bool chip = erase_block_size == 0 && flash_info.size != 0 &&
+		(outside || (begin == 0 && end >= flash_info.size)) && chip_cost < cost[0];
+
+	int count = 0;
+	struct erase_step *steps = malloc((chip ? 1 : units) * sizeof(*steps));
+	if (steps == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		jtag_error(jtag, 1);
+	}
+
+	if (chip) {
+		steps[count++] = (struct erase_step){ FLASH_OP_ERASE_CHIP, 0 };
+	} else {
+		for (uint32_t i = 0; i < units; ) {
+			if (choice[i] < 0) {
+				i++;
+				continue;
+			}
+			enum flash_op op = ops[choice[i]];
+			steps[count++] = (struct erase_step){ op, lo + i * unit };
+			i += flash_erase_bytes(op) / unit;
+		}
+	}
+
+	if (verbose)
+		fprintf(stderr, "erase plan: %d steps, about %.2f s\n", count, (chip ? chip_cost : cost[0]) * 1e-6);
+
+	free(cost);
+	free(choice);
+	*plan = steps;
+	return count;
+}
+
+/* Erases [addr, addr + size) as flash_plan_erase() plans it */
+static void flash_erase_range(struct jtag_ctx *jtag, int erase_block_size, bool outside, int addr, long size)
+{
+	struct erase_step *plan;
+	int count = flash_plan_erase(jtag, addr, size, erase_block_size, outside, &plan);
+
+	for (int i = 0; i < count; i++) {
+		flash_write_enable(jtag);
+		flash_erase_start(jtag, &plan[i]);
+		if (verbose) {
+			fprintf(stderr, "Status after block erase:\n");
+			flash_read_status(jtag);
+		}
+		flash_wait(jtag, plan[i].op);
+	}
+	free(plan);
+}
+
 // ---------------------------------------------------------
 // ECP5 specific JTAG functions
 // ---------------------------------------------------------
 
-static bool print_idcode(uint32_t idcode){
-	connected_device.id = idcode;
+static bool print_idcode(struct device_info *device, uint32_t idcode){
+	device->id = idcode;
 	
 	/* ECP5 Parts */
 	for(int i = 0; i < sizeof(ecp_devices)/sizeof(struct device_id_pair); i++){
 		if(idcode == ecp_devices[i].device_id)
 		{
-			connected_device.name = ecp_devices[i].device_name;
-			connected_device.type = TYPE_ECP5;
+			device->name = ecp_devices[i].device_name;
+			device->type = TYPE_ECP5;
 			printf("IDCODE: 0x%08x (%s)\n", idcode ,ecp_devices[i].device_name);
 			return true;
 		}
@@ -467,8 +885,8 @@ static bool print_idcode(uint32_t idcode){
 	for(int i = 0; i < sizeof(nx_devices)/sizeof(struct device_id_pair); i++){
 		if(idcode == nx_devices[i].device_id)
 		{
-			connected_device.name = nx_devices[i].device_name;
-			connected_device.type = TYPE_NX;
+			device->name = nx_devices[i].device_name;
+			device->type = TYPE_NX;
 			printf("IDCODE: 0x%08x (%s)\n", idcode ,nx_devices[i].device_name);
 			return true;
 		}
@@ -477,16 +895,16 @@ static bool print_idcode(uint32_t idcode){
 	return false;
 }
 
-static bool read_idcode(){
+static bool read_idcode(struct jtag_ctx *jtag, struct device_info *device){
 
 	uint8_t data[4] = {READ_ID};
 
-	jtag_go_to_state(STATE_SHIFT_IR);
-	jtag_tap_shift(data, data, 8, true);
+	jtag_go_to_state(jtag, STATE_SHIFT_IR);
+	jtag_tap_shift(jtag, data, data, 8, true);
 
 	data[0] = 0;
-	jtag_go_to_state(STATE_SHIFT_DR);
-	jtag_tap_shift(data, data, 32, true);
+	jtag_go_to_state(jtag, STATE_SHIFT_DR);
+	jtag_tap_shift(jtag, data, data, 32, true);
 
 	uint32_t idcode = 0;
 	
@@ -494,7 +912,72 @@ static bool read_idcode(){
 	for(int i = 0; i< 4; i++)
 		idcode = data[i] << 24 | idcode >> 8;
 
-	return print_idcode(idcode);
+	return print_idcode(device, idcode);
+}
+
+/* Lattice parts have an 8 bit instruction register */
+static unsigned lattice_ir_length(uint32_t idcode){
+	return (idcode & 0xfff) == 0x043 ? 8 : 0;
+}
+
+static bool known_idcode(uint32_t idcode){
+	for(int i = 0; i < sizeof(ecp_devices)/sizeof(struct device_id_pair); i++)
+		if(idcode == ecp_devices[i].device_id)
+			return true;
+	for(int i = 0; i < sizeof(nx_devices)/sizeof(struct device_id_pair); i++)
+		if(idcode == nx_devices[i].device_id)
+			return true;
+	return false;
+}
+
+/* Finds the devices on the JTAG chain, and lists them if there are several
+ * unless quiet is set. Returns their number, or -1. */
+static int scan_chain(struct jtag_ctx *jtag, bool quiet){
+	int count = jtag_scan_chain(jtag, lattice_ir_length);
+
+	for (int i = 0; i < count && count > 1 && !quiet; i++) {
+		const struct jtag_device *dev = jtag_device(jtag, i);
+		fprintf(stderr, "chain %d: IDCODE 0x%08x, IR %u bits\n", i, dev->idcode, dev->ir_length);
+	}
+	return count;
+}
+
+/* Points all further scans at the FPGA: target is a chain position (0 is
+ * next to TDO), an IDCODE, or -1 for the first supported ECP5/NX. */
+static bool select_target(struct jtag_ctx *jtag, int64_t target, bool quiet){
+	int count = scan_chain(jtag, quiet);
+	if (count < 0)
+		return false;
+
+	int position = -1;
+	for (int i = 0; i < count; i++) {
+		const struct jtag_device *dev = jtag_device(jtag, i);
+		bool match;
+		if (target < 0)
+			match = known_idcode(dev->idcode);
+		else if (target < JTAG_MAX_DEVICES)
+			match = target == i;
+		else
+			match = target == dev->idcode;
+		if (match && position < 0)
+			position = i;
+	}
+
+	/* Nothing we know, leave it to the IDCODE check */
+	if (position < 0 && target < 0)
+		position = 0;
+	if (position < 0) {
+		if (target < JTAG_MAX_DEVICES)
+			fprintf(stderr, "no device at position %d on the JTAG chain\n", (int)target);
+		else
+			fprintf(stderr, "no device with IDCODE 0x%08x on the JTAG chain\n", (uint32_t)target);
+		return false;
+	}
+
+	if (!quiet && count > 1)
+		fprintf(stderr, "target: chain position %d\n", position);
+	jtag_select_device(jtag, position);
+	return true;
 }
 
 void print_ecp5_status_register(uint32_t status){	
@@ -643,19 +1126,19 @@ void print_nx_status_register(uint64_t status){
 
 }
 
-static void read_status_register(){
+static void read_status_register(struct jtag_ctx *jtag, const struct device_info *device){
 
 	uint8_t data[8] = {LSC_READ_STATUS};
 
-	jtag_go_to_state(STATE_SHIFT_IR);
-	jtag_tap_shift(data, data, 8, true);
+	jtag_go_to_state(jtag, STATE_SHIFT_IR);
+	jtag_tap_shift(jtag, data, data, 8, true);
 
 	data[0] = 0;
-	jtag_go_to_state(STATE_SHIFT_DR);
-	//jtag_go_to_state(STATE_PAUSE_DR);
+	jtag_go_to_state(jtag, STATE_SHIFT_DR);
+	//jtag_go_to_state(jtag, STATE_PAUSE_DR);
 	
-	if(connected_device.type == TYPE_ECP5){
-		jtag_tap_shift(data, data, 32, true);
+	if(device->type == TYPE_ECP5){
+		jtag_tap_shift(jtag, data, data, 32, true);
 		uint32_t status = 0;
 		
 		/* Format the status into a 32bit value */
@@ -663,9 +1146,9 @@ static void read_status_register(){
 			status = data[i] << 24 | status >> 8;
 
 		print_ecp5_status_register(status);
-	}else if(connected_device.type == TYPE_NX){
+	}else if(device->type == TYPE_NX){
 
-		jtag_tap_shift(data, data, 64, true);
+		jtag_tap_shift(jtag, data, data, 64, true);
 
 		uint64_t status = 0;
 		
@@ -679,46 +1162,589 @@ static void read_status_register(){
 
 
 
-static void enter_spi_background_mode(){
+static void enter_spi_background_mode(struct jtag_ctx *jtag){
 
 	uint8_t data[4] = {0x3A};
 
-	jtag_go_to_state(STATE_SHIFT_IR);
-	jtag_tap_shift(data, data, 8, true);
+	jtag_go_to_state(jtag, STATE_SHIFT_IR);
+	jtag_queue_shift(jtag, data, NULL, 8, true);
 
 	/* These bytes seem to be required to un-lock the SPI interface */
 	data[0] = 0xFE;
 	data[1] = 0x68;
-	jtag_go_to_state(STATE_SHIFT_DR);
-	jtag_tap_shift(data, data, 16, true);
+	jtag_go_to_state(jtag, STATE_SHIFT_DR);
+	jtag_queue_shift(jtag, data, NULL, 16, true);
 
 	/* Entering IDLE is essential */
-	jtag_go_to_state(STATE_RUN_TEST_IDLE);
+	jtag_go_to_state(jtag, STATE_RUN_TEST_IDLE);
 }
 
 
-void ecp_jtag_cmd(uint8_t cmd){
+void ecp_jtag_cmd(struct jtag_ctx *jtag, uint8_t cmd){
 	uint8_t data[1] = {cmd};
 
-	jtag_go_to_state(STATE_SHIFT_IR);
-	jtag_tap_shift(data, data, 8, true);
+	jtag_go_to_state(jtag, STATE_SHIFT_IR);
+	jtag_queue_shift(jtag, data, NULL, 8, true);
 
-	jtag_go_to_state(STATE_RUN_TEST_IDLE);
-	jtag_wait_time(32);	
+	jtag_go_to_state(jtag, STATE_RUN_TEST_IDLE);
+	jtag_run_clocks(jtag, 32);
 }
 
-void ecp_jtag_cmd8(uint8_t cmd, uint8_t param){
+void ecp_jtag_cmd8(struct jtag_ctx *jtag, uint8_t cmd, uint8_t param){
 	uint8_t data[1] = {cmd};
 
-	jtag_go_to_state(STATE_SHIFT_IR);
-	jtag_tap_shift(data, data, 8, true);
+	jtag_go_to_state(jtag, STATE_SHIFT_IR);
+	jtag_queue_shift(jtag, data, NULL, 8, true);
 
 	data[0] = param;
-	jtag_go_to_state(STATE_SHIFT_DR);
-	jtag_tap_shift(data, data, 8, true);
+	jtag_go_to_state(jtag, STATE_SHIFT_DR);
+	jtag_queue_shift(jtag, data, NULL, 8, true);
+
+	jtag_go_to_state(jtag, STATE_RUN_TEST_IDLE);
+	jtag_run_clocks(jtag, 32);
+}
+
+/* Reset the FPGA to release the SPI interface, then pass SPI through JTAG */
+static void enter_flash_mode(struct jtag_ctx *jtag)
+{
+	ecp_jtag_cmd8(jtag, ISC_ENABLE, 0);
+	jtag_wait_time(jtag, 10000);
+	ecp_jtag_cmd8(jtag, ISC_ERASE, 0);
+	jtag_wait_time(jtag, 10000);
+	ecp_jtag_cmd8(jtag, ISC_DISABLE, 0);
 
-	jtag_go_to_state(STATE_RUN_TEST_IDLE);
-	jtag_wait_time(32);	
+	/* Put device into SPI bypass mode */
+	enter_spi_background_mode(jtag);
+
+	flash_reset(jtag);
+}
+
+// ---------------------------------------------------------
+// Gang programming
+// ---------------------------------------------------------
+
+#define GANG_MAX_BOARDS 32
+
+/* Known good clock that -k auto trains from, 1 MHz */
+#define CLKDIV_TRAIN_START 30
+
+/* TCK settings from -k and -K */
+struct clock_setup {
+	int clkdiv;
+	bool clk_auto;
+	int bulk_clkdiv;    /* 0: same as clkdiv */
+	bool bulk_auto;
+};
+
+/* What a board in the gang gets, shared read-only between the workers */
+struct gang_job {
+	const char *filename;
+	const uint8_t *image;
+	long image_size;
+	struct clock_setup clock;
+	int64_t target;
+	int rw_offset;
+	int erase_block_size;
+	bool erase_outside;
+	bool bulk_erase;
+	bool dont_erase;
+	bool disable_protect;
+	bool disable_verify;
+	bool idcode_match;
+	bool reinitialize;
+};
+
+struct gang_board {
+	const struct gang_job *job;
+	const char *devstr;
+	const char *serial;
+	int ifnum;
+	pthread_t thread;
+
+	/* Filled in by the worker */
+	const char *stage;
+	uint32_t idcode;
+	unsigned tck_hz;
+	unsigned bulk_tck_hz;
+	int status;
+	double seconds;
+};
+
+/* Opens the JTAG session and sets up the control and bulk data clocks. Auto
+ * training finds the fastest clock for bulk data; with -k auto the control
+ * traffic runs at half that rate, as it is small and latency bound anyway. */
+static struct jtag_ctx *open_jtag(int ifnum, const char *devstr, const struct clock_setup *clock)
+{
+	struct jtag_ctx *jtag = jtag_init(ifnum, devstr, clock->clk_auto ? CLKDIV_TRAIN_START : clock->clkdiv);
+
+	int control = clock->clkdiv;
+	int bulk = clock->bulk_clkdiv ? clock->bulk_clkdiv : clock->clkdiv;
+
+	if (clock->clk_auto || clock->bulk_auto) {
+		int trained = jtag_train_clock(jtag);
+		if (clock->clk_auto) {
+			control = trained * 2 < CLKDIV_TRAIN_START ? trained * 2 : CLKDIV_TRAIN_START;
+			if (!clock->bulk_clkdiv)
+				bulk = trained;
+		}
+		if (clock->bulk_auto)
+			bulk = trained;
+	}
+
+	jtag_set_clkdiv(jtag, JTAG_PHASE_CONTROL, control);
+	jtag_set_clkdiv(jtag, JTAG_PHASE_BULK, bulk);
+	return jtag;
+}
+
+/* Reads a whole file, or stdin for "-", into memory */
+static uint8_t *read_image(const char *filename, long *size)
+{
+	FILE *f = (strcmp(filename, "-") == 0) ? stdin : fopen(filename, "rb");
+	if (f == NULL)
+		return NULL;
+
+	uint8_t *image = NULL;
+	long alloc = 0;
+	*size = 0;
+
+	while (true) {
+		if (*size == alloc) {
+			alloc = alloc ? alloc * 2 : 1024 * 1024;
+			uint8_t *p = realloc(image, alloc);
+			if (p == NULL)
+				break;
+			image = p;
+		}
+		size_t rc = fread(image + *size, 1, alloc - *size, f);
+		if (rc == 0)
+			break;
+		*size += rc;
+	}
+
+	if (ferror(f) || image == NULL || *size == alloc) {
+		free(image);
+		image = NULL;
+	}
+	if (f != stdin)
+		fclose(f);
+	return image;
+}
+
+/* Program and verify one board. A hardware error ends the thread from within
+ * jtag_error(), b->stage then tells how far it got. */
+static void *gang_worker(void *arg)
+{
+	struct gang_board *b = arg;
+	const struct gang_job *job = b->job;
+	double start = time_seconds();
+
+	b->stage = "init";
+	struct jtag_ctx *jtag = open_jtag(b->ifnum, b->devstr, &job->clock);
+	b->tck_hz = jtag_tck_hz(jtag, JTAG_PHASE_CONTROL);
+	b->bulk_tck_hz = jtag_tck_hz(jtag, JTAG_PHASE_BULK);
+	if (!select_target(jtag, job->target, true))
+		jtag_error(jtag, 2);
+	struct device_info device = {0};
+
+	bool ok_id = read_idcode(jtag, &device);
+	b->idcode = device.id;
+	if (job->idcode_match && !ok_id) {
+		jtag_deinit(jtag);
+		return (void *)(intptr_t)1;
+	}
+
+	b->stage = "reset";
+	enter_flash_mode(jtag);
+	flash_read_sfdp(jtag);
+	flash_check_range(jtag, job->rw_offset, job->image_size);
+
+	if (job->disable_protect) {
+		flash_write_enable(jtag);
+		flash_disable_protection(jtag);
+	}
+
+	b->stage = "erase";
+	if (job->bulk_erase) {
+		flash_write_enable(jtag);
+		flash_bulk_erase(jtag);
+		flash_wait(jtag, FLASH_OP_ERASE_CHIP);
+	} else if (!job->dont_erase) {
+		flash_erase_range(jtag, job->erase_block_size, job->erase_outside, job->rw_offset, job->image_size);
+	}
+
+	b->stage = "program";
+	for (long rc, addr = 0; addr < job->image_size; addr += rc) {
+		rc = flash_info.page_size - (job->rw_offset + addr) % flash_info.page_size;
+		if (rc > job->image_size - addr)
+			rc = job->image_size - addr;
+
+		flash_prog_page(jtag, job->rw_offset + addr, job->image + addr, rc);
+	}
+
+	if (!job->disable_verify) {
+		b->stage = "verify";
+		long len = jtag_transfer_size(jtag);
+		uint8_t *buffer = malloc(len);
+		if (buffer == NULL)
+			jtag_error(jtag, 1);
+
+		for (long rc, addr = 0; addr < job->image_size; addr += rc) {
+			rc = job->image_size - addr > len ? len : job->image_size - addr;
+			flash_read(jtag, job->rw_offset + addr, buffer, rc);
+			if (memcmp(buffer, job->image + addr, rc)) {
+				b->seconds = time_seconds() - start;
+				free(buffer);
+				jtag_deinit(jtag);
+				return (void *)(intptr_t)3;
+			}
+		}
+		free(buffer);
+	}
+
+	if (job->reinitialize)
+		ecp_jtag_cmd(jtag, LSC_REFRESH);
+
+	b->stage = "done";
+	b->seconds = time_seconds() - start;
+	jtag_deinit(jtag);
+	return (void *)(intptr_t)0;
+}
+
+/* Runs one worker per board, then prints a table of the results.
+ * Returns the worst exit status of all boards. */
+static int gang_program(struct gang_board *boards, int board_count)
+{
+	int worst = 0;
+
+	mpsse_set_thread_abort(true);
+
+	for (int i = 0; i < board_count; i++) {
+		boards[i].stage = "start";
+		boards[i].seconds = -1;
+		if (pthread_create(&boards[i].thread, NULL, gang_worker, &boards[i])) {
+			fprintf(stderr, "can't start worker for %s\n", boards[i].devstr);
+			boards[i].status = 1;
+			boards[i].thread = pthread_self();
+		}
+	}
+
+	for (int i = 0; i < board_count; i++) {
+		void *status;
+		if (pthread_equal(boards[i].thread, pthread_self()))
+			continue;
+		pthread_join(boards[i].thread, &status);
+		boards[i].status = (int)(intptr_t)status;
+	}
+
+	mpsse_set_thread_abort(false);
+
+	printf("\n%-5s %-24s %-4s %-16s %-10s %-12s %-18s %-7s %s\n", "board", "device", "if", "serial", "IDCODE", "TCK", "result", "time", "file");
+	for (int i = 0; i < board_count; i++) {
+		struct gang_board *b = &boards[i];
+		char result[32];
+
+		if (b->status == 0)
+			snprintf(result, sizeof(result), "OK");
+		else if (b->status == 3)
+			snprintf(result, sizeof(result), "VERIFY FAILED");
+		else
+			snprintf(result, sizeof(result), "FAILED (%s)", b->stage);
+
+		char seconds[16] = "-";
+		if (b->seconds >= 0)
+			snprintf(seconds, sizeof(seconds), "%.2fs", b->seconds);
+
+		char tck[24] = "-";
+		if (b->tck_hz)
+			snprintf(tck, sizeof(tck), "%.2f/%.2fM", b->tck_hz / 1e6, b->bulk_tck_hz / 1e6);
+
+		printf("%-5d %-24s %-4c %-16s 0x%08x %-12s %-18s %-7s %s\n", i, b->devstr, 'A' + b->ifnum,
+			b->serial[0] ? b->serial : "-", b->idcode, tck, result, seconds, b->job->filename);
+
+		if (b->status > worst)
+			worst = b->status;
+	}
+
+	return worst;
+}
+
+// ---------------------------------------------------------
+// Chain programming
+// ---------------------------------------------------------
+
+/* -T all: every supported FPGA on the chain */
+#define TARGET_ALL -2
+
+/* One FPGA on the chain, and how far its flash has got. Only one FPGA at a
+ * time passes SPI through, the flashes of the others keep on erasing or
+ * programming meanwhile. Each flash has its own geometry, erase plan and
+ * learned durations. */
+struct chain_target {
+	unsigned position;
+	struct flash_info info;
+	unsigned typical_us[FLASH_OPS];
+	struct erase_step *plan;
+	int erase_steps;
+	bool bulk_erase;
+	int next_erase;         /* Step of the erase plan to start next */
+	long next_page;         /* Image offset of the next page to program */
+	bool busy;
+	bool done;
+	enum flash_op op;       /* What the flash is busy with */
+	double started;
+	double next_poll;
+	double polled;          /* When the last batch of polls started */
+	uint32_t step;          /* Poll spacing in us, as flash_wait() spaces them */
+	uint8_t status[FLASH_POLLS][2]; /* Replies to the last batch of polls */
+};
+
+/* The flash functions work on the thread's flash_info and durations: put
+ * those of the current target away, and bring in the ones of t */
+static void chain_use_flash(struct chain_target *t, struct chain_target **current)
+{
+	if (*current == t)
+		return;
+
+	if (*current != NULL) {
+		(*current)->info = flash_info;
+		memcpy((*current)->typical_us, flash_typical_us, sizeof(flash_typical_us));
+	}
+	flash_info = t->info;
+	memcpy(flash_typical_us, t->typical_us, sizeof(flash_typical_us));
+	*current = t;
+}
+
+/* Connects the SPI pass through to the flash of t */
+static void chain_switch(struct jtag_ctx *jtag, struct chain_target *t, struct chain_target **current)
+{
+	if (*current == t)
+		return;
+
+	jtag_select_device(jtag, t->position);
+	enter_spi_background_mode(jtag);
+	chain_use_flash(t, current);
+}
+
+/* Writes the same image to the flash of every supported FPGA on the chain.
+ * Each round starts the next erase or page program on every idle flash and
+ * then polls all busy ones at once, so the flash latencies of the devices
+ * overlap instead of adding up.
+ * Returns 0, or 3 if the verification of any device failed. */
+static int chain_program(struct jtag_ctx *jtag, const struct gang_job *job)
+{
+	struct chain_target targets[JTAG_MAX_DEVICES];
+	struct chain_target *current = NULL;
+	int count = 0;
+	int status = 0;
+
+	int devices = scan_chain(jtag, false);
+	if (devices < 0)
+		jtag_error(jtag, 2);
+	for (int i = 0; i < devices; i++)
+		if (known_idcode(jtag_device(jtag, i)->idcode))
+			targets[count++] = (struct chain_target){ .position = i, .info = flash_info };
+	for (int i = 0; i < count; i++)
+		memcpy(targets[i].typical_us, flash_typical_us, sizeof(flash_typical_us));
+	if (count == 0) {
+		fprintf(stderr, "no ECP5/NX on the JTAG chain\n");
+		jtag_error(jtag, 2);
+	}
+
+	for (int i = 0; i < count; i++) {
+		struct chain_target *t = &targets[i];
+		struct device_info device = {0};
+
+		fprintf(stderr, "reset device %u..\n", t->position);
+		jtag_select_device(jtag, t->position);
+		read_idcode(jtag, &device);
+		enter_flash_mode(jtag);
+		chain_use_flash(t, &current);
+		flash_read_id(jtag);
+		flash_read_sfdp(jtag);
+		flash_print_info();
+		flash_check_range(jtag, job->rw_offset, job->image_size);
+
+		/* Flashes that differ each get the plan and pages that suit them */
+		if (i > 0 && (flash_info.size != targets[0].info.size || flash_info.page_size != targets[0].info.page_size ||
+		              memcmp(flash_info.erase_cmd, targets[0].info.erase_cmd, sizeof(flash_info.erase_cmd))))
+			fprintf(stderr, "flash of device %u differs from that of device %u\n", t->position, targets[0].position);
+
+		if (job->disable_protect) {
+			flash_write_enable(jtag);
+			flash_disable_protection(jtag);
+		}
+
+		t->bulk_erase = job->bulk_erase;
+		if (!job->bulk_erase && !job->dont_erase)
+			t->erase_steps = flash_plan_erase(jtag, job->rw_offset, job->image_size, job->erase_block_size, job->erase_outside, &t->plan);
+	}
+
+	int remaining = count;
+	int timeouts = 0;
+	long written = 0;
+	long shown = -1;
+	while (remaining > 0) {
+		for (int i = 0; i < count; i++) {
+			struct chain_target *t = &targets[i];
+			if (t->busy || t->done)
+				continue;
+
+			chain_switch(jtag, t, &current);
+			if (t->bulk_erase) {
+				flash_write_enable(jtag);
+				flash_bulk_erase(jtag);
+				t->bulk_erase = false;
+				t->op = FLASH_OP_ERASE_CHIP;
+			} else if (t->next_erase < t->erase_steps) {
+				flash_write_enable(jtag);
+				flash_erase_start(jtag, &t->plan[t->next_erase]);
+				t->op = t->plan[t->next_erase++].op;
+			} else if (t->next_page < job->image_size) {
+				long n = flash_info.page_size - (job->rw_offset + t->next_page) % flash_info.page_size;
+				if (n > job->image_size - t->next_page)
+					n = job->image_size - t->next_page;
+
+				flash_write_enable(jtag);
+				flash_prog(jtag, job->rw_offset + t->next_page, job->image + t->next_page, n);
+				t->next_page += n;
+				written += n;
+				t->op = FLASH_OP_PROGRAM;
+			} else {
+				t->done = true;
+				remaining--;
+				continue;
+			}
+
+			uint32_t wait;
+			flash_poll_schedule(flash_typical_us[t->op], &wait, &t->step);
+			t->started = time_seconds();
+			t->next_poll = t->started + wait * 1e-6;
+			t->busy = true;
+		}
+
+		/* Wait for the first busy flash to be due, then poll them all in
+		 * batches of FLASH_POLLS rounds, as flash_wait() does */
+		double due = 0;
+		uint32_t step = FLASH_POLL_MAX_US;
+		for (int i = 0; i < count; i++) {
+			struct chain_target *t = &targets[i];
+			if (!t->busy)
+				continue;
+			if (due == 0 || t->next_poll < due)
+				due = t->next_poll;
+			if (t->step < step)
+				step = t->step;
+		}
+		if (due == 0)
+			continue;
+
+		double polled = time_seconds();
+		if (due - polled > FLASH_HOST_WAIT_US * 1e-6) {
+			jtag_flush(jtag);
+			usleep((due - polled) * 1e6);
+			polled = time_seconds();
+		} else if (due > polled) {
+			jtag_go_to_state(jtag, STATE_RUN_TEST_IDLE);
+			jtag_wait_time(jtag, (due - polled) * 1e6);
+			polled = due;
+		}
+
+		/* One flash after the other, saving on switches: each batch then
+		 * starts that much later */
+		double offset = 0;
+		for (int i = 0; i < count; i++) {
+			struct chain_target *t = &targets[i];
+			if (!t->busy)
+				continue;
+
+			chain_switch(jtag, t, &current);
+			for (int r = 0; r < FLASH_POLLS; r++) {
+				if (r > 0) {
+					jtag_go_to_state(jtag, STATE_RUN_TEST_IDLE);
+					jtag_wait_time(jtag, step);
+				}
+				t->status[r][0] = FC_RSR1;
+				t->status[r][1] = 0;
+				jtag_queue_stream(jtag, t->status[r], t->status[r], 16, true);
+			}
+			t->polled = polled + offset;
+			offset += (FLASH_POLLS - 1) * step * 1e-6;
+		}
+
+		/* A lost status read is harmless, just ask again */
+		if (jtag_flush(jtag) != MPSSE_OK) {
+			if (++timeouts > 3) {
+				fprintf(stderr, "flash not responding.\n");
+				jtag_error(jtag, 2);
+			}
+			continue;
+		}
+
+		for (int i = 0; i < count; i++) {
+			struct chain_target *t = &targets[i];
+			if (!t->busy)
+				continue;
+
+			int r = 0;
+			while (r < FLASH_POLLS && (t->status[r][1] & 0x01))
+				r++;
+
+			if (r < FLASH_POLLS) {
+				/* Learned into the target's own durations */
+				unsigned *typical_us = t == current ? flash_typical_us : t->typical_us;
+				typical_us[t->op] = flash_learn(typical_us[t->op], (t->polled - t->started) * 1e6 + r * step);
+				t->busy = false;
+			} else if (t->polled >= t->next_poll) {
+				t->next_poll = t->polled + FLASH_POLLS * step * 1e-6;
+				t->step = t->step * 2 < FLASH_POLL_MAX_US ? t->step * 2 : FLASH_POLL_MAX_US;
+			}
+		}
+
+		/* Once per page, as the single device progress */
+		if (written != shown) {
+			fprintf(stderr, "\r\033[0Kprogramming..  %04ld/%04ld", written, job->image_size * count);
+			shown = written;
+		}
+	}
+	fprintf(stderr, "\n");
+	for (int i = 0; i < count; i++)
+		free(targets[i].plan);
+
+	if (!job->disable_verify) {
+		long len = jtag_transfer_size(jtag);
+		uint8_t *buffer = malloc(len);
+		if (buffer == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			jtag_error(jtag, 1);
+		}
+
+		for (int i = 0; i < count; i++) {
+			struct chain_target *t = &targets[i];
+			bool ok = true;
+
+			chain_switch(jtag, t, &current);
+			for (long rc, addr = 0; addr < job->image_size && ok; addr += rc) {
+				rc = job->image_size - addr > len ? len : job->image_size - addr;
+				flash_read(jtag, job->rw_offset + addr, buffer, rc);
+				ok = !memcmp(buffer, job->image + addr, rc);
+			}
+
+			fprintf(stderr, "device %u: %s\n", t->position, ok ? "VERIFY OK" : "found difference between flash and file!");
+			if (!ok)
+				status = 3;
+		}
+		free(buffer);
+	}
+
+	if (job->reinitialize) {
+		fprintf(stderr, "rebooting ECP5s...\n");
+		for (int i = 0; i < count; i++) {
+			jtag_select_device(jtag, targets[i].position);
+			ecp_jtag_cmd(jtag, LSC_REFRESH);
+		}
+	}
+
+	return status;
 }
 
 // ---------------------------------------------------------
@@ -731,43 +1757,67 @@ static void help(const char *progname)
 	fprintf(stderr, "Usage: %s [-b|-n|-c] <input file>\n", progname);
 	fprintf(stderr, "       %s -r|-R<bytes> <output file>\n", progname);
 	fprintf(stderr, "       %s -S <input file>\n", progname);
+	fprintf(stderr, "       %s -J <svf file>\n", progname);
 	fprintf(stderr, "       %s -t\n", progname);
+	fprintf(stderr, "       %s -g [-d <device string>]... [-I [ABCD]]... <input file>...\n", progname);
 	fprintf(stderr, "\n");
 	fprintf(stderr, "General options:\n");
-	fprintf(stderr, "  -d <device string>    use the specified USB device [default: i:0x0403:0x6010 or i:0x0403:0x6014]\n");
+	fprintf(stderr, "  -d <device string>    use the specified USB device [default: i:0x0403:0x6010, 0x6011 or 0x6014]\n");
 	fprintf(stderr, "                          d:<devicenode>               (e.g. d:002/005)\n");
 	fprintf(stderr, "                          i:<vendor>:<product>         (e.g. i:0x0403:0x6010)\n");
 	fprintf(stderr, "                          i:<vendor>:<product>:<index> (e.g. i:0x0403:0x6010:0)\n");
 	fprintf(stderr, "                          s:<vendor>:<product>:<serial-string>\n");
 	fprintf(stderr, "  -I [ABCD]             connect to the specified interface on the FTDI chip\n");
-	fprintf(stderr, "                          [default: A]\n");
+	fprintf(stderr, "                          [default: A] (may be repeated with -g)\n");
 	fprintf(stderr, "  -o <offset in bytes>  start address for read/write [default: 0]\n");
 	fprintf(stderr, "                          (append 'k' to the argument for size in kilobytes,\n");
 	fprintf(stderr, "                          or 'M' for size in megabytes)\n");
-	fprintf(stderr, "  -k <divider>          divider for SPI clock [default: 1]\n");
-	fprintf(stderr, "                          clock speed is 6MHz/divider");
-	fprintf(stderr, "  -s                    slow SPI. (50 kHz instead of 6 MHz)\n");
+	fprintf(stderr, "  -k <divider>|auto     divider for JTAG clock [default: 1]\n");
+	fprintf(stderr, "                          clock speed is 30MHz/divider (6MHz/divider on FT2232D)\n");
+	fprintf(stderr, "                          auto: use the fastest clock the board passes a\n");
+	fprintf(stderr, "                          bit error test at, with a safety margin\n");
+	fprintf(stderr, "                          (control traffic then runs at half that)\n");
+	fprintf(stderr, "  -K <divider>|auto     divider for JTAG clock while streaming flash and\n");
+	fprintf(stderr, "                          SRAM data [default: same as -k]\n");
+	fprintf(stderr, "  -s                    slow SPI. (1 MHz instead of 30 MHz)\n");
 	fprintf(stderr, "                          Equivalent to -k 30\n");
 	fprintf(stderr, "  -v                    verbose output\n");
-	fprintf(stderr, "  -i [4,32,64]          select erase block size [default: 64k]\n");
+	fprintf(stderr, "  -i [4,32,64]          erase in aligned blocks of this size only\n");
 	fprintf(stderr, "  -a                    reinitialize the device after any operation\n");
 	fprintf(stderr, "  -z                    IDCODE read out must match known supported device\n");
+	fprintf(stderr, "  -T <position>|<IDCODE>|all\n");
+	fprintf(stderr, "                        FPGA to use on a JTAG chain of several devices, by\n");
+	fprintf(stderr, "                          position (0 is closest to TDO) or by IDCODE\n");
+	fprintf(stderr, "                          [default: the first ECP5/NX found]\n");
+	fprintf(stderr, "                          all: write the flash of every ECP5/NX on the chain,\n");
+	fprintf(stderr, "                          overlapping their erase and program times\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Mode of operation:\n");
 	fprintf(stderr, "  [default]             write file contents to flash, then verify\n");
 	fprintf(stderr, "  -X                    write file contents to flash only\n");	
-	fprintf(stderr, "  -r                    read first 256 kB from flash and write to file\n");
+	fprintf(stderr, "  -r                    read the whole flash and write to file (the first\n");
+	fprintf(stderr, "                          256 kB if its size is unknown)\n");
 	fprintf(stderr, "  -R <size in bytes>    read the specified number of bytes from flash\n");
 	fprintf(stderr, "                          (append 'k' to the argument for size in kilobytes,\n");
 	fprintf(stderr, "                          or 'M' for size in megabytes)\n");
 	fprintf(stderr, "  -c                    do not write flash, only verify (`check')\n");
 	fprintf(stderr, "  -S                    perform SRAM programming\n");
 	fprintf(stderr, "  -t                    just read the flash ID sequence\n");
+	fprintf(stderr, "  -J                    play back the input file as SVF (SIR, SDR, HIR, HDR,\n");
+	fprintf(stderr, "                          TIR, TDR, RUNTEST, STATE, ...), checking TDO data\n");
+	fprintf(stderr, "  -g                    gang mode: write and verify the file on all attached\n");
+	fprintf(stderr, "                          programmers at once, or on every device given with -d\n");
+	fprintf(stderr, "                          Repeat -I to use several interfaces of each programmer\n");
+	fprintf(stderr, "                          in parallel, with one input file each or one for all.\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Erase mode (only meaningful in default mode):\n");
-	fprintf(stderr, "  [default]             erase aligned chunks of 64kB in write mode\n");
-	fprintf(stderr, "                          This means that some data after the written data (or\n");
-	fprintf(stderr, "                          even before when -o is used) may be erased as well.\n");
+	fprintf(stderr, "  [default]             erase the written range with the quickest mix of\n");
+	fprintf(stderr, "                          the 4, 32 and 64kB erases the flash has. Only the\n");
+	fprintf(stderr, "                          rest of the first and last 4kB sectors is erased\n");
+	fprintf(stderr, "                          as well. With -i the range is rounded out to the\n");
+	fprintf(stderr, "                          erase block size instead.\n");
+	fprintf(stderr, "  -E                    allow erasing whole blocks, or the entire flash,\n");
+	fprintf(stderr, "                          around the written range when that is quicker\n");
 	fprintf(stderr, "  -b                    bulk erase entire flash before writing\n");
 	fprintf(stderr, "  -e <size in bytes>    erase flash as if we were writing that number of bytes\n");
 	fprintf(stderr, "  -n                    do not erase flash before writing\n");
@@ -799,11 +1849,12 @@ int main(int argc, char **argv)
 		if (argv[0][i] == '/')
 			my_name = argv[0] + i + 1;
 
-	int read_size = 256 * 1024;
-	int erase_block_size = 64;
+	int read_size = 0;          /* 0: the whole flash */
+	int erase_block_size = 0;   /* 0: any mix, as planned */
 	int erase_size = 0;
 	int rw_offset = 0;
-	int clkdiv = 1;
+	struct clock_setup clock = { .clkdiv = 1 };
+	int64_t target = -1;
 
 	bool reinitialize = false;
 	bool idcode_match = false;
@@ -811,13 +1862,20 @@ int main(int argc, char **argv)
 	bool check_mode = false;
 	bool erase_mode = false;
 	bool bulk_erase = false;
+	bool erase_outside = false;
 	bool dont_erase = false;
 	bool prog_sram = false;
 	bool test_mode = false;
+	bool svf_mode = false;
 	bool disable_protect = false;
 	bool disable_verify = false;
+	bool gang_mode = false;
 	const char *filename = NULL;
 	const char *devstr = NULL;
+	const char *devstrs[GANG_MAX_BOARDS];
+	int devstr_count = 0;
+	int ifnums[4];
+	int ifnum_count = 0;
 	int ifnum = 0;
 
 #ifdef _WIN32
@@ -833,10 +1891,15 @@ int main(int argc, char **argv)
 	/* Decode command line parameters */
 	int opt;
 	char *endptr;
-	while ((opt = getopt_long(argc, argv, "d:i:I:rR:e:o:k:scazbnStvpX", long_options, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "d:i:I:rR:e:o:k:K:T:scazbEnStJvpXg", long_options, NULL)) != -1) {
 		switch (opt) {
 		case 'd': /* device string */
 			devstr = optarg;
+			if (devstr_count == GANG_MAX_BOARDS) {
+				fprintf(stderr, "%s: too many device strings (at most %d)\n", my_name, GANG_MAX_BOARDS);
+				return EXIT_FAILURE;
+			}
+			devstrs[devstr_count++] = optarg;
 			break;
 		case 'i': /* block erase size */
 			if (!strcmp(optarg, "4"))
@@ -863,8 +1926,15 @@ int main(int argc, char **argv)
 				fprintf(stderr, "%s: `%s' is not a valid interface (must be `A', `B', `C', or `D')\n", my_name, optarg);
 				return EXIT_FAILURE;
 			}
+			for (int i = 0; i < ifnum_count; i++) {
+				if (ifnums[i] == ifnum) {
+					fprintf(stderr, "%s: interface `%s' given more than once\n", my_name, optarg);
+					return EXIT_FAILURE;
+				}
+			}
+			ifnums[ifnum_count++] = ifnum;
 			break;
-		case 'r': /* Read 256 bytes to file */
+		case 'r': /* Read the whole flash to file */
 			read_mode = true;
 			break;
 		case 'R': /* Read n bytes to file */
@@ -909,14 +1979,40 @@ int main(int argc, char **argv)
 			}
 			break;
 		case 'k': /* set clock div */
-			clkdiv = strtol(optarg, &endptr, 0);
-                        if (clkdiv < 1 || clkdiv > 65536) {
+			if (!strcmp(optarg, "auto")) {
+				clock.clk_auto = true;
+				break;
+			}
+			clock.clkdiv = strtol(optarg, &endptr, 0);
+                        if (*endptr != '\0' || clock.clkdiv < 1 || clock.clkdiv > 65536) {
 				fprintf(stderr, "%s: clock divider must be in range 1-65536 `%s' is not a valid divider\n", my_name, optarg);
 				return EXIT_FAILURE;
                         }
 			break;
+		case 'K': /* set clock div for bulk data */
+			if (!strcmp(optarg, "auto")) {
+				clock.bulk_auto = true;
+				break;
+			}
+			clock.bulk_clkdiv = strtol(optarg, &endptr, 0);
+			if (*endptr != '\0' || clock.bulk_clkdiv < 1 || clock.bulk_clkdiv > 65536) {
+				fprintf(stderr, "%s: clock divider must be in range 1-65536 `%s' is not a valid divider\n", my_name, optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'T': /* select the FPGA on the JTAG chain */
+			if (!strcmp(optarg, "all")) {
+				target = TARGET_ALL;
+				break;
+			}
+			target = strtoll(optarg, &endptr, 0);
+			if (*endptr != '\0' || target < 0 || target > 0xffffffff) {
+				fprintf(stderr, "%s: `%s' is not a valid chain position or IDCODE\n", my_name, optarg);
+				return EXIT_FAILURE;
+			}
+			break;
 		case 's': /* use slow SPI clock */
-			clkdiv = 30;
+			clock.clkdiv = 30;
 			break;
 		case 'c': /* do not write just check */
 			check_mode = true;
@@ -930,6 +2026,9 @@ int main(int argc, char **argv)
 		case 'b': /* bulk erase before writing */
 			bulk_erase = true;
 			break;
+		case 'E': /* erase outside the range when quicker */
+			erase_outside = true;
+			break;
 		case 'n': /* do not erase before writing */
 			dont_erase = true;
 			break;
@@ -939,6 +2038,9 @@ int main(int argc, char **argv)
 		case 't': /* just read flash id */
 			test_mode = true;
 			break;
+		case 'J': /* play back an SVF file */
+			svf_mode = true;
+			break;
 		case 'v': /* provide verbose output */
 			verbose = true;
 			break;
@@ -948,6 +2050,9 @@ int main(int argc, char **argv)
 		case 'X': /* disable verification */
 			disable_verify = true;
 			break;
+		case 'g': /* program all adapters at once */
+			gang_mode = true;
+			break;
 		case -2:
 			help(argv[0]);
 			return EXIT_SUCCESS;
@@ -960,27 +2065,45 @@ int main(int argc, char **argv)
 
 	/* Make sure that the combination of provided parameters makes sense */
 
-	if (read_mode + erase_mode + check_mode + prog_sram + test_mode > 1) {
-		fprintf(stderr, "%s: options `-r'/`-R', `-e`, `-c', `-S', and `-t' are mutually exclusive\n", my_name);
+	if (read_mode + erase_mode + check_mode + prog_sram + test_mode + svf_mode > 1) {
+		fprintf(stderr, "%s: options `-r'/`-R', `-e`, `-c', `-S', `-t' and `-J' are mutually exclusive\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (gang_mode && (read_mode || erase_mode || check_mode || prog_sram || test_mode || svf_mode)) {
+		fprintf(stderr, "%s: option `-g' only valid in programming mode\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (devstr_count > 1 && !gang_mode) {
+		fprintf(stderr, "%s: more than one `-d' requires `-g'\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (ifnum_count > 1 && !gang_mode) {
+		fprintf(stderr, "%s: more than one `-I' requires `-g'\n", my_name);
 		return EXIT_FAILURE;
 	}
 
+	if (ifnum_count == 0)
+		ifnums[ifnum_count++] = ifnum;
+
 	if (bulk_erase && dont_erase) {
 		fprintf(stderr, "%s: options `-b' and `-n' are mutually exclusive\n", my_name);
 		return EXIT_FAILURE;
 	}
 
-	if (disable_protect && (read_mode || check_mode || prog_sram || test_mode)) {
+	if (disable_protect && (read_mode || check_mode || prog_sram || test_mode || svf_mode)) {
 		fprintf(stderr, "%s: option `-p' only valid in programming mode\n", my_name);
 		return EXIT_FAILURE;
 	}
 
-	if (bulk_erase && (read_mode || check_mode || prog_sram || test_mode)) {
+	if (bulk_erase && (read_mode || check_mode || prog_sram || test_mode || svf_mode)) {
 		fprintf(stderr, "%s: option `-b' only valid in programming mode\n", my_name);
 		return EXIT_FAILURE;
 	}
 
-	if (dont_erase && (read_mode || check_mode || prog_sram || test_mode)) {
+	if (dont_erase && (read_mode || check_mode || prog_sram || test_mode || svf_mode)) {
 		fprintf(stderr, "%s: option `-n' only valid in programming mode\n", my_name);
 		return EXIT_FAILURE;
 	}
@@ -995,6 +2118,96 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	if (rw_offset != 0 && svf_mode) {
+		fprintf(stderr, "%s: option `-o' not supported in SVF mode\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (target != -1 && svf_mode) {
+		fprintf(stderr, "%s: option `-T' not supported in SVF mode\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (target == TARGET_ALL && (read_mode || erase_mode || check_mode || prog_sram || test_mode || gang_mode)) {
+		fprintf(stderr, "%s: option `-T all' only valid in programming mode\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (gang_mode) {
+		/* One input file for every interface, or one shared by all of them */
+		int file_count = argc - optind;
+		if (file_count != 1 && file_count != ifnum_count) {
+			fprintf(stderr, "%s: gang mode takes one input file, or one per `-I' interface\n", my_name);
+			fprintf(stderr, "Try `%s --help' for more information.\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+
+		static struct gang_job jobs[4];
+		static struct gang_board boards[GANG_MAX_BOARDS];
+		static struct mpsse_device devices[GANG_MAX_BOARDS];
+		int board_count = 0;
+
+		/* One copy of each image, shared by all workers */
+		for (int i = 0; i < file_count; i++) {
+			jobs[i] = (struct gang_job){
+				.filename = argv[optind + i],
+				.clock = clock,
+				.target = target,
+				.rw_offset = rw_offset,
+				.erase_block_size = erase_block_size,
+				.erase_outside = erase_outside,
+				.bulk_erase = bulk_erase,
+				.dont_erase = dont_erase,
+				.disable_protect = disable_protect,
+				.disable_verify = disable_verify,
+				.idcode_match = idcode_match,
+				.reinitialize = reinitialize,
+			};
+			jobs[i].image = read_image(jobs[i].filename, &jobs[i].image_size);
+			if (jobs[i].image == NULL) {
+				fprintf(stderr, "%s: can't read '%s': ", my_name, jobs[i].filename);
+				perror(0);
+				return EXIT_FAILURE;
+			}
+		}
+
+		bool enumerated = devstr_count == 0;
+		if (enumerated) {
+			int device_count = mpsse_find_devices(devices, GANG_MAX_BOARDS);
+			for (int i = 0; i < device_count; i++)
+				devstrs[devstr_count++] = devices[i].devstr;
+		}
+
+		/* Every interface of every adapter is a board of its own */
+		for (int i = 0; i < devstr_count; i++) {
+			for (int j = 0; j < ifnum_count; j++) {
+				if (board_count == GANG_MAX_BOARDS) {
+					fprintf(stderr, "%s: too many boards (at most %d)\n", my_name, GANG_MAX_BOARDS);
+					return EXIT_FAILURE;
+				}
+				struct gang_board *b = &boards[board_count++];
+				b->job = &jobs[file_count == 1 ? 0 : j];
+				b->devstr = devstrs[i];
+				b->serial = enumerated ? devices[i].serial : "";
+				b->ifnum = ifnums[j];
+			}
+		}
+
+		if (board_count == 0) {
+			fprintf(stderr, "%s: no programmers found\n", my_name);
+			return 2;
+		}
+
+		/* Pick the bit vector code before the workers need it */
+		bitvec_get_isa();
+		fprintf(stderr, "programming %d boards..\n", board_count);
+		int status = gang_program(boards, board_count);
+
+		for (int i = 0; i < file_count; i++)
+			free((void *)jobs[i].image);
+		return status;
+	}
+
 	if (optind + 1 == argc) {
 		if (test_mode) {
 			fprintf(stderr, "%s: test mode doesn't take a file name\n", my_name);
@@ -1050,7 +2263,7 @@ int main(int argc, char **argv)
 		   named pipe, or contrarily, the standard input may be an
 		   ordinary file. */
 
-		if (!prog_sram) {
+		if (!prog_sram && !svf_mode) {
 			if (fseek(f, 0L, SEEK_END) != -1) {
 				file_size = ftell(f);
 				if (file_size == -1) {
@@ -1099,32 +2312,83 @@ int main(int argc, char **argv)
 	// ---------------------------------------------------------
 
 	fprintf(stderr, "init..\n");
-	jtag_init(ifnum, devstr, clkdiv);
+	enum bitvec_isa isa = bitvec_get_isa();
+	if (verbose)
+		fprintf(stderr, "bit vector code: %s\n", bitvec_isa_name(isa));
+	struct jtag_ctx *jtag = open_jtag(ifnum, devstr, &clock);
+	if (clock.clk_auto || clock.bulk_auto || clock.bulk_clkdiv)
+		fprintf(stderr, "TCK: %.3f MHz control, %.3f MHz bulk data\n",
+			jtag_tck_hz(jtag, JTAG_PHASE_CONTROL) / 1e6, jtag_tck_hz(jtag, JTAG_PHASE_BULK) / 1e6);
+
+	if (svf_mode) {
+		/* The SVF file knows what is on the chain, don't touch it */
+		int rc = svf_play(jtag, f, filename);
+		if (f != stdin)
+			fclose(f);
+		jtag_deinit(jtag);
+		return rc;
+	}
+
+	if (target == TARGET_ALL) {
+		struct gang_job job = {
+			.filename = filename,
+			.image_size = file_size,
+			.rw_offset = rw_offset,
+			.erase_block_size = erase_block_size,
+			.erase_outside = erase_outside,
+			.bulk_erase = bulk_erase,
+			.dont_erase = dont_erase,
+			.disable_protect = disable_protect,
+			.disable_verify = disable_verify,
+			.reinitialize = reinitialize,
+		};
+		uint8_t *image = malloc(file_size ? file_size : 1);
+		if (image == NULL || fread(image, 1, file_size, f) != file_size) {
+			fprintf(stderr, "%s: can't read '%s'\n", my_name, filename);
+			jtag_error(jtag, 1);
+		}
+		job.image = image;
+
+		int rc = chain_program(jtag, &job);
+		free(image);
+		if (f != stdin)
+			fclose(f);
+		fprintf(stderr, "Bye.\n");
+		jtag_deinit(jtag);
+		return rc;
+	}
+
+	if (!select_target(jtag, target, false))
+		jtag_error(jtag, 2);
+
+	struct device_info device = {0};
 
-	bool ok_id = read_idcode();
+	bool ok_id = read_idcode(jtag, &device);
 	if (idcode_match && !ok_id) {
-		jtag_deinit();
+		jtag_deinit(jtag);
 		return 1;
 	}
 
-	read_status_register();
+	read_status_register(jtag, &device);
 
 	if (test_mode)
 	{
 		/* Reset ECP5 to release SPI interface */
-		ecp_jtag_cmd8(ISC_ENABLE,0);
-		usleep(10000);
-		ecp_jtag_cmd8(ISC_ERASE,0);
-		usleep(10000);
-		ecp_jtag_cmd(ISC_DISABLE);
+		ecp_jtag_cmd8(jtag, ISC_ENABLE,0);
+		jtag_wait_time(jtag, 10000);
+		ecp_jtag_cmd8(jtag, ISC_ERASE,0);
+		jtag_wait_time(jtag, 10000);
+		ecp_jtag_cmd(jtag, ISC_DISABLE);
 
 		/* Put device into SPI bypass mode */
-		enter_spi_background_mode();
+		enter_spi_background_mode(jtag);
 
-		flash_reset();
-		flash_read_id();
+		flash_reset(jtag);
+		flash_read_id(jtag);
+		flash_read_sfdp(jtag);
+		flash_print_info();
 
-		flash_read_status();
+		flash_read_status(jtag);
 	}
 	else if (prog_sram)
 	{
@@ -1133,37 +2397,43 @@ int main(int argc, char **argv)
 		// ---------------------------------------------------------
 		fprintf(stderr, "reset..\n");
 
-		ecp_jtag_cmd8(ISC_ENABLE, 0);
-		ecp_jtag_cmd8(ISC_ERASE, 0);
-		ecp_jtag_cmd8(LSC_RESET_CRC, 0);
+		ecp_jtag_cmd8(jtag, ISC_ENABLE, 0);
+		jtag_wait_time(jtag, 10000);
+		ecp_jtag_cmd8(jtag, ISC_ERASE, 0);
+		jtag_wait_time(jtag, 10000);
+		ecp_jtag_cmd8(jtag, LSC_RESET_CRC, 0);
 
-		read_status_register();
+		read_status_register(jtag, &device);
 
 		// ---------------------------------------------------------
 		// Program
 		// ---------------------------------------------------------
 
 		fprintf(stderr, "programming..\n");
-		ecp_jtag_cmd(LSC_BITSTREAM_BURST);
+		ecp_jtag_cmd(jtag, LSC_BITSTREAM_BURST);
+		const uint32_t len = jtag_transfer_size(jtag);
+		unsigned char *buffer = malloc(len);
+		if (buffer == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			jtag_error(jtag, 1);
+		}
+		jtag_set_phase(jtag, JTAG_PHASE_BULK);
 		while (1) {
-			const uint32_t len = 16*1024;
-			static unsigned char buffer[16*1024];
 			int rc = fread(buffer, 1, len, f);
 			if (rc <= 0)
 				break;
 			if (verbose)
 				fprintf(stderr, "sending %d bytes.\n", rc);
 
-			for(int i = 0; i < rc; i++){
-				buffer[i] = bit_reverse(buffer[i]);
-			}
-
-			jtag_go_to_state(STATE_CAPTURE_DR);
-			jtag_tap_shift(buffer, buffer, rc*8, false);
+			/* The bitstream goes out MSB first, as it is */
+			jtag_go_to_state(jtag, STATE_CAPTURE_DR);
+			jtag_queue_shift_msb(jtag, buffer, NULL, rc*8, false);
 		}
+		jtag_set_phase(jtag, JTAG_PHASE_CONTROL);
+		free(buffer);
 	
-		ecp_jtag_cmd(ISC_DISABLE);
-		read_status_register();	
+		ecp_jtag_cmd(jtag, ISC_DISABLE);
+		read_status_register(jtag, &device);	
 	}
 	else /* program flash */
 	{
@@ -1172,18 +2442,15 @@ int main(int argc, char **argv)
 		// ---------------------------------------------------------
 
 		fprintf(stderr, "reset..\n");
-		/* Reset ECP5 to release SPI interface */
-		ecp_jtag_cmd8(ISC_ENABLE, 0);
-		ecp_jtag_cmd8(ISC_ERASE, 0);
-		ecp_jtag_cmd8(ISC_DISABLE, 0);
-
-		/* Put device into SPI bypass mode */
-		enter_spi_background_mode();
+		enter_flash_mode(jtag);
 
-		flash_reset();
-
-		flash_read_id();
+		flash_read_id(jtag);
+		flash_read_sfdp(jtag);
+		flash_print_info();
 
+		if (read_mode && read_size == 0)
+			read_size = flash_info.size > (uint32_t)rw_offset ? (int)flash_info.size - rw_offset : 256 * 1024;
+		flash_check_range(jtag, rw_offset, read_mode ? read_size : file_size);
 
 		// ---------------------------------------------------------
 		// Program
@@ -1193,66 +2460,46 @@ int main(int argc, char **argv)
 		{
 			if (disable_protect)
 			{
-				flash_write_enable();
-				flash_disable_protection();
+				flash_write_enable(jtag);
+				flash_disable_protection(jtag);
 			}
 			
 			if (!dont_erase)
 			{
 				if (bulk_erase)
 				{
-					flash_write_enable();
-					flash_bulk_erase();
-					flash_wait();
+					flash_write_enable(jtag);
+					flash_bulk_erase(jtag);
+					flash_wait(jtag, FLASH_OP_ERASE_CHIP);
 				}
 				else
 				{
 					fprintf(stderr, "file size: %ld\n", file_size);
 
-					int block_size = erase_block_size << 10;
-					int block_mask = block_size - 1;
-					int begin_addr = rw_offset & ~block_mask;
-					int end_addr = (rw_offset + file_size + block_mask) & ~block_mask;
-
-					for (int addr = begin_addr; addr < end_addr; addr += block_size) {
-						flash_write_enable();
-						switch(erase_block_size) {
-							case 4:
-								flash_4kB_sector_erase(addr);
-								break;
-							case 32:
-								flash_32kB_sector_erase(addr);
-								break;
-							case 64:
-								flash_64kB_sector_erase(addr);
-								break;
-						}
-						if (verbose) {
-							fprintf(stderr, "Status after block erase:\n");
-							flash_read_status();
-						}
-						flash_wait();
-					}
+					flash_erase_range(jtag, erase_block_size, erase_outside, rw_offset, file_size);
 				}
 			}
 
 			if (!erase_mode)
 			{
-				for (int rc, addr = 0; true; addr += rc) {
-					uint8_t buffer[256];
+				uint8_t *buffer = malloc(flash_info.page_size);
+				if (buffer == NULL) {
+					fprintf(stderr, "Out of memory.\n");
+					jtag_error(jtag, 1);
+				}
 
+				for (int rc, addr = 0; true; addr += rc) {
 					/* Show progress */
 					fprintf(stderr, "\r\033[0Kprogramming..  %04u/%04lu", addr, file_size);
 
-					int page_size = 256 - (rw_offset + addr) % 256;
+					int page_size = flash_info.page_size - (rw_offset + addr) % flash_info.page_size;
 					rc = fread(buffer, 1, page_size, f);
 					if (rc <= 0)
 						break;
-					flash_write_enable();
-					flash_prog(rw_offset + addr, buffer, rc);
-					flash_wait();
+					flash_prog_page(jtag, rw_offset + addr, buffer, rc);
 
 				}
+				free(buffer);
 
 				fprintf(stderr, "\n");
 				/* seek to the beginning for second pass */
@@ -1264,46 +2511,53 @@ int main(int argc, char **argv)
 		// Read/Verify
 		// ---------------------------------------------------------
 
+		int len = jtag_transfer_size(jtag);
+		uint8_t *buffer_flash = malloc(len);
+		uint8_t *buffer_file = malloc(len);
+		if (buffer_flash == NULL || buffer_file == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			jtag_error(jtag, 1);
+		}
+
 		if (read_mode) {
 
-			flash_start_read(rw_offset);
-			for (int addr = 0; addr < read_size; addr += 4096) {
-				uint8_t buffer[4096];
+			for (int rc, addr = 0; addr < read_size; addr += rc) {
+				rc = read_size - addr > len ? len : read_size - addr;
 
 				/* Show progress */
-				fprintf(stderr, "\r\033[0Kreading..    %04u/%04u", addr + 4096, read_size);
+				fprintf(stderr, "\r\033[0Kreading..    %04u/%04u", addr + rc, read_size);
 
-				flash_continue_read(buffer, 4096);
-				fwrite(buffer, read_size - addr > 4096 ? 4096 : read_size - addr, 1, f);
+				flash_read(jtag, rw_offset + addr, buffer_flash, rc);
+				fwrite(buffer_flash, rc, 1, f);
 			}
 			fprintf(stderr, "\n");
 		} else if (!erase_mode && !disable_verify) {
 			
-			flash_start_read(rw_offset);
-			for (int addr = 0; addr < file_size; addr += 4096) {
-				uint8_t buffer_flash[4096], buffer_file[4096];
-
-				int rc = fread(buffer_file, 1, 4096, f);
+			for (int addr = 0; addr < file_size; addr += len) {
+				int rc = fread(buffer_file, 1, len, f);
 				if (rc <= 0)
 					break;
 				
-				flash_continue_read(buffer_flash, rc);
+				flash_read(jtag, rw_offset + addr, buffer_flash, rc);
 				
 				/* Show progress */
 				fprintf(stderr, "\r\033[0Kverify..       %04u/%04lu", addr + rc, file_size);
 				if (memcmp(buffer_file, buffer_flash, rc)) {
 					fprintf(stderr, "Found difference between flash and file!\n");
-					jtag_error(3);
+					jtag_error(jtag, 3);
 				}
 
 			}
 			fprintf(stderr, "  VERIFY OK\n");
 		}
+
+		free(buffer_flash);
+		free(buffer_file);
 	}
 
 	if (reinitialize) {
 		fprintf(stderr, "rebooting ECP5...\n");
-		ecp_jtag_cmd(LSC_REFRESH);
+		ecp_jtag_cmd(jtag, LSC_REFRESH);
 	}
 
 	if (f != NULL && f != stdin && f != stdout)
@@ -1314,6 +2568,6 @@ int main(int argc, char **argv)
 	// ---------------------------------------------------------
 
 	fprintf(stderr, "Bye.\n");
-	jtag_deinit();
+	jtag_deinit(jtag);
 	return 0;
 }
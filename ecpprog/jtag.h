@@ -30,40 +30,232 @@ typedef enum e_TAPState
 	STATE_UPDATE_IR        = 15
 } jtag_tap_state_t;
 
+/* Traffic classes that can run at different TCK rates */
+enum jtag_phase {
+	JTAG_PHASE_CONTROL = 0, /* TAP management, IDCODE, status reads and polls */
+	JTAG_PHASE_BULK    = 1, /* Flash and SRAM data streams */
+	JTAG_PHASES
+};
+
+
+/**
+ * A JTAG session on one adapter channel. Owns the MPSSE channel, its
+ * command queue and the TAP state; sessions are independent of each other.
+ */
+struct jtag_ctx;
+
+/* Results of up to this many queued scans and callbacks wait for a flush */
+#define JTAG_QUEUE_DEPTH 256
+
+typedef void (*jtag_callback_t)(void *arg);
+
+/* Longest chain jtag_scan_chain() looks for */
+#define JTAG_MAX_DEVICES 16
+
+/* A TAP found on the chain. Position 0 is the one closest to TDO. */
+struct jtag_device {
+	uint32_t idcode;        /* 0 if the device comes up in BYPASS */
+	unsigned ir_length;
+};
+
+/* IR length of a device known by its IDCODE, 0 if unknown */
+typedef unsigned (*jtag_ir_length_t)(uint32_t idcode);
+
+/* One piece of a scan: bits of TDI data taken from input, and where their
+ * TDO data goes. Either may be NULL, see jtag_queue_shift(). */
+struct jtag_segment {
+	const uint8_t *input;
+	uint8_t *output;
+	uint32_t bits;
+};
+
 
 /**
  * Performs the start-of-day tasks necessary to talk JTAG to our FPGA.
  */
-void jtag_init(int ifnum, const char *devstr, int clkdiv);
+struct jtag_ctx *jtag_init(int ifnum, const char *devstr, int clkdiv);
 
 
 /**
  * De-inits the JTAG connection, so the JTAG chain. is no longer driven.
  */
-void jtag_deinit(void);
+void jtag_deinit(struct jtag_ctx *jtag);
+
+
+/**
+ * Moves to a given JTAG state. Queued, like jtag_wait_time().
+ */
+void jtag_go_to_state(struct jtag_ctx *jtag, unsigned state);
+
+
+/**
+ * Queues a TAP scan. input_data is copied right away; the TDO data is
+ * written to output_data by the next jtag_flush(). When the result queue
+ * is full it is flushed on the spot.
+ *
+ * Only the directions that are asked for go over USB: without output_data
+ * the adapter sends no TDO data back, and without input_data it sends no
+ * TDI data out, TDI just keeps its level.
+ *
+ * With a device selected, scans in SHIFT-IR and SHIFT-DR address its
+ * registers only: the BYPASS bits of the other devices are added in front
+ * of the first scan after Capture and behind a scan with must_end, and are
+ * cut out of the TDO data again. Otherwise the scan is sent as is.
+ */
+void jtag_queue_shift(
+	struct jtag_ctx *jtag,
+	const uint8_t *input_data,
+	uint8_t *output_data,
+	uint32_t data_bits,
+	bool must_end);
+
+/**
+ * jtag_queue_shift() for byte streams that go out MSB first, like the ECP5
+ * bitstream: bit 7 of each byte is shifted first, and the TDO data is packed
+ * the same way. A last partial byte uses its upper bits.
+ */
+void jtag_queue_shift_msb(
+	struct jtag_ctx *jtag,
+	const uint8_t *input_data,
+	uint8_t *output_data,
+	uint32_t data_bits,
+	bool must_end);
 
+/**
+ * Queues a scan made up of the given segments, shifted back to back as if
+ * they were one buffer. Nothing is put together on the way: the input of
+ * each segment goes straight into the command queue, and its TDO data is
+ * written straight to its output, which must start on a byte of its own.
+ */
+void jtag_queue_segments(
+	struct jtag_ctx *jtag,
+	const struct jtag_segment *segments,
+	unsigned count,
+	bool must_end);
+
+/**
+ * Queues a scan that streams data through the DR of the selected device
+ * rather than loading it, like SPI through the ECP5: the device sees exactly
+ * input_data while it is in SHIFT-DR, and output_data gets exactly what it
+ * returned. Enters SHIFT-DR if not there yet. With other devices on the
+ * chain, output_data must be NULL unless must_end is set.
+ *
+ * Like SPI, stream bytes go out MSB first, see jtag_queue_shift_msb(), so
+ * SPI commands and data are passed as they are.
+ */
+void jtag_queue_stream(
+	struct jtag_ctx *jtag,
+	const uint8_t *input_data,
+	uint8_t *output_data,
+	uint32_t data_bits,
+	bool must_end);
 
 /**
- * Moves to a given JTAG state.
+ * jtag_queue_stream() on the given segments, like jtag_queue_segments().
+ * On a chain the TDO data of the target lags behind its input by the BYPASS
+ * bits, so it is collected in one place and copied out of there by
+ * jtag_flush(). The first scan of a stream is put together in one buffer
+ * on a chain, and so are reads whose segments aren't whole bytes.
  */
-void jtag_goto_state(int state);
+void jtag_queue_stream_segments(
+	struct jtag_ctx *jtag,
+	const struct jtag_segment *segments,
+	unsigned count,
+	bool must_end);
 
+/**
+ * Queues a call to callback(arg), made by jtag_flush() once the results of
+ * all scans queued before it have been delivered.
+ */
+void jtag_queue_callback(struct jtag_ctx *jtag, jtag_callback_t callback, void *arg);
 
 /**
- * Performs a raw TAP scan.
+ * Performs a TAP scan like jtag_queue_shift() and waits for its result.
+ * Returns MPSSE_OK, or MPSSE_ERR_TIMEOUT if the adapter stopped responding.
  */
-void jtag_tap_shift(
+int jtag_tap_shift(
+	struct jtag_ctx *jtag,
 	uint8_t *input_data,
 	uint8_t *output_data,
 	uint32_t data_bits,
 	bool must_end);
 
-void jtag_error(int status);
+void jtag_error(struct jtag_ctx *jtag, int status);
+
+/**
+ * Sends all queued commands, waits for their TDO data and delivers the
+ * results and callbacks in queue order.
+ * Returns MPSSE_OK, or MPSSE_ERR_TIMEOUT if the adapter stopped responding
+ * at any point since the last flush; results and callbacks are then dropped.
+ */
+int jtag_flush(struct jtag_ctx *jtag);
+
+/**
+ * Preferred number of bytes per jtag_tap_shift() for bulk data, sized to
+ * the FIFOs of the attached FTDI chip.
+ */
+unsigned jtag_transfer_size(struct jtag_ctx *jtag);
+
+/**
+ * Queues a wait of at least the given time in the current state, normally
+ * Run-Test/Idle, as the number of TCK cycles it takes at the current rate.
+ * No host sleep is involved: the wait runs in the adapter, in line with
+ * the commands queued around it.
+ */
+void jtag_wait_time(struct jtag_ctx *jtag, uint32_t microseconds);
+
+/**
+ * Queues exactly the given number of TCK cycles in the current state.
+ */
+void jtag_run_clocks(struct jtag_ctx *jtag, uint64_t clocks);
+
+/**
+ * Sets the TCK divider used for a phase, both start out at the divider given
+ * to jtag_init().
+ */
+void jtag_set_clkdiv(struct jtag_ctx *jtag, enum jtag_phase phase, unsigned clkdiv);
+unsigned jtag_get_clkdiv(struct jtag_ctx *jtag, enum jtag_phase phase);
+
+/**
+ * Switches TCK to the rate of the given phase, if it differs from the current
+ * one. Queued, does not wait for anything.
+ */
+void jtag_set_phase(struct jtag_ctx *jtag, enum jtag_phase phase);
+
+/**
+ * Finds the fastest TCK at which IDCODE reads and a BYPASS loopback of random
+ * data run without bit errors, starting from the fastest divider, and returns
+ * it with a safety margin applied. The control phase divider is taken as the
+ * known good starting point, and is in use again on return. The whole chain
+ * is trained, a selected device stays selected afterwards.
+ */
+unsigned jtag_train_clock(struct jtag_ctx *jtag);
+
+/**
+ * TCK frequency of a phase in Hz.
+ */
+unsigned jtag_tck_hz(struct jtag_ctx *jtag, enum jtag_phase phase);
 
-void jtag_wait_time(uint32_t microseconds);
+uint8_t jtag_current_state(struct jtag_ctx *jtag);
 
-void jtag_go_to_state(unsigned state);
+/**
+ * Finds the devices on the chain: reads the IDCODE or BYPASS register every
+ * TAP selects after Test-Logic-Reset, then the length of all instruction
+ * registers together. ir_length() tells the IR length of known devices, the
+ * others are split up along the 01 pattern each one captures. Leaves all
+ * devices in BYPASS and none selected.
+ * Returns the number of devices, or -1 if the chain made no sense.
+ */
+int jtag_scan_chain(struct jtag_ctx *jtag, jtag_ir_length_t ir_length);
+
+unsigned jtag_device_count(struct jtag_ctx *jtag);
+const struct jtag_device *jtag_device(struct jtag_ctx *jtag, unsigned position);
 
-uint8_t jtag_current_state(void);
+/**
+ * Makes all further scans address the device at the given chain position,
+ * see jtag_queue_shift(). The BYPASS bits around it are worked out here,
+ * once.
+ */
+void jtag_select_device(struct jtag_ctx *jtag, unsigned position);
 
 #endif
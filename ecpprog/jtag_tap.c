@@ -15,8 +15,60 @@
 
 #include "mpsse.h"
 #include "jtag.h"
+#include "bitvec.h"
 
-void jtag_state_ack(bool tms);
+/* Something to do once the replies of the queue have arrived: unpack the
+ * last partial byte of a scan, cut the payload out of a scan with BYPASS
+ * bits around it, or call back into the application. */
+struct jtag_pending {
+	uint8_t rx[2];          /* Replies to the bit mode data and the TMS bit */
+	uint8_t *output;
+	uint8_t bits;
+	bool tms;
+	bool msb;               /* Bytes of output are filled MSB first */
+
+	const uint8_t *source;  /* If set, copy source_bits from here to output */
+	uint32_t source_offset;
+	uint32_t source_bits;
+
+	jtag_callback_t callback;
+	void *arg;
+};
+
+/* A JTAG session on one MPSSE channel */
+struct jtag_ctx {
+	struct mpsse_ctx *mpsse;
+	uint8_t current_state;
+	bool tdi;               /* Level TDI was last driven to, it stays there */
+
+	/* TCK divider of each phase, and the phase we are in */
+	unsigned clkdiv[JTAG_PHASES];
+	enum jtag_phase phase;
+
+	/* Results waiting for the queue to be flushed, in queue order */
+	struct jtag_pending pending[JTAG_QUEUE_DEPTH];
+	unsigned pending_count;
+	int queue_status;
+
+	/* The chain, and the BYPASS bits of the other devices around the
+	 * selected one. Header bits are shifted first, trailer bits last. */
+	struct jtag_device devices[JTAG_MAX_DEVICES];
+	unsigned device_count;
+	bool selected;
+	unsigned ir_header, ir_trailer;
+	unsigned dr_header, dr_trailer;
+	bool scan_start;        /* Capture passed, nothing shifted since */
+
+	/* Scans with BYPASS bits are put together here, and their TDO data
+	 * waits in the arena until jtag_flush() cuts the payload out */
+	uint8_t *fold;
+	size_t fold_size;
+	uint8_t *arena;
+	size_t arena_size;
+	size_t arena_used;
+};
+
+static void jtag_state_ack(struct jtag_ctx *jtag, bool tms);
 
 /*
  * Low nibble : TMS == 0
@@ -44,154 +96,269 @@ static const uint8_t tms_transitions[] = {
 	/* STATE_UPDATE_IR        */ TMS_T(STATE_SELECT_DR_SCAN,   STATE_RUN_TEST_IDLE),
 };
 
-#define BITSTR(A, B, C, D, E, F, G, H, I, J, K, L, M, N, O, P) ( \
-	((uint16_t)(A) << 15) | \
-	((uint16_t)(B) << 14) | \
-	((uint16_t)(C) << 13) | \
-	((uint16_t)(D) << 12) | \
-	((uint16_t)(E) << 11) | \
-	((uint16_t)(F) << 10) | \
-	((uint16_t)(G) <<  9) | \
-	((uint16_t)(H) <<  8) | \
-	((uint16_t)(I) <<  7) | \
-	((uint16_t)(J) <<  6) | \
-	((uint16_t)(K) <<  5) | \
-	((uint16_t)(L) <<  4) | \
-	((uint16_t)(M) <<  3) | \
-	((uint16_t)(N) <<  2) | \
-	((uint16_t)(O) <<  1) | \
-	((uint16_t)(P) <<  0) )
-
 /*
- * The index of this vector is the current state. The i-th bit tells you the
- * value TMS must assume in order to go to state "i".
-
-------------------------------------------------------------------------------------------------------------
-|                        |   || F | E | D | C || B | A | 9 | 8 || 7 | 6 | 5 | 4 || 3 | 2 | 1 | 0 ||   HEX  |
-------------------------------------------------------------------------------------------------------------
-| STATE_TEST_LOGIC_RESET | 0 || 0 | 0 | 0 | 0 || 0 | 0 | 0 | 0 || 0 | 0 | 0 | 0 || 0 | 0 | 0 | 1 || 0x0001 |
-| STATE_RUN_TEST_IDLE    | 1 || 1 | 1 | 1 | 1 || 1 | 1 | 1 | 1 || 1 | 1 | 1 | 1 || 1 | 1 | 0 | 1 || 0xFFFD |
-| STATE_SELECT_DR_SCAN   | 2 || 1 | 1 | 1 | 1 || 1 | 1 | 1 | 0 || 0 | 0 | 0 | 0 || 0 | x | 1 | 1 || 0xFE03 |
-| STATE_CAPTURE_DR       | 3 || 1 | 1 | 1 | 1 || 1 | 1 | 1 | 1 || 1 | 1 | 1 | 0 || x | 1 | 1 | 1 || 0xFFE7 |
-| STATE_SHIFT_DR         | 4 || 1 | 1 | 1 | 1 || 1 | 1 | 1 | 1 || 1 | 1 | 1 | 0 || 1 | 1 | 1 | 1 || 0xFFEF |
-| STATE_EXIT1_DR         | 5 || 1 | 1 | 1 | 1 || 1 | 1 | 1 | 1 || 0 | 0 | x | 0 || 1 | 1 | 1 | 1 || 0xFF0F |
-| STATE_PAUSE_DR         | 6 || 1 | 1 | 1 | 1 || 1 | 1 | 1 | 1 || 1 | 0 | 1 | 1 || 1 | 1 | 1 | 1 || 0xFFBF |
-| STATE_EXIT2_DR         | 7 || 1 | 1 | 1 | 1 || 1 | 1 | 1 | 1 || x | 0 | 0 | 0 || 1 | 1 | 1 | 1 || 0xFF0F |
-| STATE_UPDATE_DR        | 8 || 1 | 1 | 1 | 1 || 1 | 1 | 1 | x || 1 | 1 | 1 | 1 || 1 | 1 | 0 | 1 || 0xFEFD |
-| STATE_SELECT_IR_SCAN   | 9 || 0 | 0 | 0 | 0 || 0 | 0 | x | 1 || 1 | 1 | 1 | 1 || 1 | 1 | 1 | 1 || 0x01FF |
-| STATE_CAPTURE_IR       | A || 1 | 1 | 1 | 1 || 0 | x | 1 | 1 || 1 | 1 | 1 | 1 || 1 | 1 | 1 | 1 || 0xF3FF |
-| STATE_SHIFT_IR         | B || 1 | 1 | 1 | 1 || 0 | 1 | 1 | 1 || 1 | 1 | 1 | 1 || 1 | 1 | 1 | 1 || 0xF7FF |
-| STATE_EXIT1_IR         | C || 1 | 0 | 0 | x || 0 | 1 | 1 | 1 || 1 | 1 | 1 | 1 || 1 | 1 | 1 | 1 || 0x87FF |
-| STATE_PAUSE_IR         | D || 1 | 1 | 0 | 1 || 1 | 1 | 1 | 1 || 1 | 1 | 1 | 1 || 1 | 1 | 1 | 1 || 0xDFFF |
-| STATE_EXIT2_IR         | E || 1 | x | 0 | 0 || 0 | 1 | 1 | 1 || 1 | 1 | 1 | 1 || 1 | 1 | 1 | 1 || 0x87FF |
-| STATE_UPDATE_IR        | F || x | 1 | 1 | 1 || 1 | 1 | 1 | 1 || 1 | 1 | 1 | 1 || 1 | 1 | 0 | 1 || 0x7FFD |
-------------------------------------------------------------------------------------------------------------
-
-*/
-static const uint16_t tms_map[] = {
-/* STATE_TEST_LOGIC_RESET */ BITSTR(  0, 0, 0, 0,   0, 0, 0, 0,   0, 0, 0, 0,   0, 0, 0, 1  ),
-/* STATE_RUN_TEST_IDLE    */ BITSTR(  1, 1, 1, 1,   1, 1, 1, 1,   1, 1, 1, 1,   1, 1, 0, 1  ),
-/* STATE_SELECT_DR_SCAN   */ BITSTR(  1, 1, 1, 1,   1, 1, 1, 0,   0, 0, 0, 0,   0, 0, 1, 1  ),
-/* STATE_CAPTURE_DR       */ BITSTR(  1, 1, 1, 1,   1, 1, 1, 1,   1, 1, 1, 0,   0, 1, 1, 1  ),
-/* STATE_SHIFT_DR         */ BITSTR(  1, 1, 1, 1,   1, 1, 1, 1,   1, 1, 1, 0,   1, 1, 1, 1  ),
-/* STATE_EXIT1_DR         */ BITSTR(  1, 1, 1, 1,   1, 1, 1, 1,   0, 0, 0, 0,   1, 1, 1, 1  ),
-/* STATE_PAUSE_DR         */ BITSTR(  1, 1, 1, 1,   1, 1, 1, 1,   1, 0, 1, 1,   1, 1, 1, 1  ),
-/* STATE_EXIT2_DR         */ BITSTR(  1, 1, 1, 1,   1, 1, 1, 1,   0, 0, 0, 0,   1, 1, 1, 1  ),
-/* STATE_UPDATE_DR        */ BITSTR(  1, 1, 1, 1,   1, 1, 1, 0,   1, 1, 1, 1,   1, 1, 0, 1  ),
-/* STATE_SELECT_IR_SCAN   */ BITSTR(  0, 0, 0, 0,   0, 0, 0, 1,   1, 1, 1, 1,   1, 1, 1, 1  ),
-/* STATE_CAPTURE_IR       */ BITSTR(  1, 1, 1, 1,   0, 0, 1, 1,   1, 1, 1, 1,   1, 1, 1, 1  ),
-/* STATE_SHIFT_IR         */ BITSTR(  1, 1, 1, 1,   0, 1, 1, 1,   1, 1, 1, 1,   1, 1, 1, 1  ),
-/* STATE_EXIT1_IR         */ BITSTR(  1, 0, 0, 0,   0, 1, 1, 1,   1, 1, 1, 1,   1, 1, 1, 1  ),
-/* STATE_PAUSE_IR         */ BITSTR(  1, 1, 0, 1,   1, 1, 1, 1,   1, 1, 1, 1,   1, 1, 1, 1  ),
-/* STATE_EXIT2_IR         */ BITSTR(  1, 0, 0, 0,   0, 1, 1, 1,   1, 1, 1, 1,   1, 1, 1, 1  ),
-/* STATE_UPDATE_IR        */ BITSTR(  0, 1, 1, 1,   1, 1, 1, 1,   1, 1, 1, 1,   1, 1, 0, 1  ),
+ * Shortest TMS sequence from the state of the row to the state of the
+ * column, generated with a breadth first search over tms_transitions.
+ * High byte: number of clocks, low byte: TMS values, bit 0 first.
+ * Only the walks from CAPTURE/SHIFT/PAUSE-DR to EXIT2-IR need 8 clocks.
+ */
+static const uint16_t tms_paths[16][16] = {
+	/* STATE_TEST_LOGIC_RESET */ { 0x0000, 0x0100, 0x0202, 0x0302, 0x0402, 0x040a, 0x050a, 0x062a, 0x051a, 0x0306, 0x0406, 0x0506, 0x0516, 0x0616, 0x0756, 0x0636 },
+	/* STATE_RUN_TEST_IDLE    */ { 0x0307, 0x0000, 0x0101, 0x0201, 0x0301, 0x0305, 0x0405, 0x0515, 0x040d, 0x0203, 0x0303, 0x0403, 0x040b, 0x050b, 0x062b, 0x051b },
+	/* STATE_SELECT_DR_SCAN   */ { 0x0203, 0x0303, 0x0000, 0x0100, 0x0200, 0x0202, 0x0302, 0x040a, 0x0306, 0x0101, 0x0201, 0x0301, 0x0305, 0x0405, 0x0515, 0x040d },
+	/* STATE_CAPTURE_DR       */ { 0x051f, 0x0303, 0x0307, 0x0000, 0x0100, 0x0101, 0x0201, 0x0305, 0x0203, 0x040f, 0x050f, 0x060f, 0x062f, 0x072f, 0x08af, 0x076f },
+	/* STATE_SHIFT_DR         */ { 0x051f, 0x0303, 0x0307, 0x0407, 0x0000, 0x0101, 0x0201, 0x0305, 0x0203, 0x040f, 0x050f, 0x060f, 0x062f, 0x072f, 0x08af, 0x076f },
+	/* STATE_EXIT1_DR         */ { 0x040f, 0x0201, 0x0203, 0x0303, 0x0302, 0x0000, 0x0100, 0x0202, 0x0101, 0x0307, 0x0407, 0x0507, 0x0517, 0x0617, 0x0757, 0x0637 },
+	/* STATE_PAUSE_DR         */ { 0x051f, 0x0303, 0x0307, 0x0407, 0x0201, 0x0305, 0x0000, 0x0101, 0x0203, 0x040f, 0x050f, 0x060f, 0x062f, 0x072f, 0x08af, 0x076f },
+	/* STATE_EXIT2_DR         */ { 0x040f, 0x0201, 0x0203, 0x0303, 0x0100, 0x0202, 0x0302, 0x0000, 0x0101, 0x0307, 0x0407, 0x0507, 0x0517, 0x0617, 0x0757, 0x0637 },
+	/* STATE_UPDATE_DR        */ { 0x0307, 0x0100, 0x0101, 0x0201, 0x0301, 0x0305, 0x0405, 0x0515, 0x0000, 0x0203, 0x0303, 0x0403, 0x040b, 0x050b, 0x062b, 0x051b },
+	/* STATE_SELECT_IR_SCAN   */ { 0x0101, 0x0201, 0x0305, 0x0405, 0x0505, 0x0515, 0x0615, 0x0755, 0x0635, 0x0000, 0x0100, 0x0200, 0x0202, 0x0302, 0x040a, 0x0306 },
+	/* STATE_CAPTURE_IR       */ { 0x051f, 0x0303, 0x0307, 0x0407, 0x0507, 0x0517, 0x0617, 0x0757, 0x0637, 0x040f, 0x0000, 0x0100, 0x0101, 0x0201, 0x0305, 0x0203 },
+	/* STATE_SHIFT_IR         */ { 0x051f, 0x0303, 0x0307, 0x0407, 0x0507, 0x0517, 0x0617, 0x0757, 0x0637, 0x040f, 0x050f, 0x0000, 0x0101, 0x0201, 0x0305, 0x0203 },
+	/* STATE_EXIT1_IR         */ { 0x040f, 0x0201, 0x0203, 0x0303, 0x0403, 0x040b, 0x050b, 0x062b, 0x051b, 0x0307, 0x0407, 0x0302, 0x0000, 0x0100, 0x0202, 0x0101 },
+	/* STATE_PAUSE_IR         */ { 0x051f, 0x0303, 0x0307, 0x0407, 0x0507, 0x0517, 0x0617, 0x0757, 0x0637, 0x040f, 0x050f, 0x0201, 0x0305, 0x0000, 0x0101, 0x0203 },
+	/* STATE_EXIT2_IR         */ { 0x040f, 0x0201, 0x0203, 0x0303, 0x0403, 0x040b, 0x050b, 0x062b, 0x051b, 0x0307, 0x0407, 0x0100, 0x0202, 0x0302, 0x0000, 0x0101 },
+	/* STATE_UPDATE_IR        */ { 0x0307, 0x0100, 0x0101, 0x0201, 0x0301, 0x0305, 0x0405, 0x0515, 0x040d, 0x0203, 0x0303, 0x0403, 0x040b, 0x050b, 0x062b, 0x0000 },
 };
 
-static uint8_t current_state;
+uint8_t jtag_current_state(struct jtag_ctx *jtag)
+{
+	return jtag->current_state;
+}
+
+void jtag_set_current_state(struct jtag_ctx *jtag, uint8_t state)
+{
+	jtag->current_state = state;
+}
+
+void jtag_error(struct jtag_ctx *jtag, int status){
+	mpsse_error(jtag->mpsse, status);
+}
+
+void jtag_deinit(struct jtag_ctx *jtag){
+	mpsse_close(jtag->mpsse);
+	free(jtag->fold);
+	free(jtag->arena);
+	free(jtag);
+}
+
+int jtag_flush(struct jtag_ctx *jtag){
+	int status = mpsse_flush(jtag->mpsse);
+	if (jtag->queue_status != MPSSE_OK)
+		status = jtag->queue_status;
+	jtag->queue_status = MPSSE_OK;
+
+	/* After a timeout the replies are garbage, drop them */
+	for (unsigned i = 0; i < jtag->pending_count && status == MPSSE_OK; i++) {
+		struct jtag_pending *p = &jtag->pending[i];
+
+		if (p->source != NULL && p->msb) {
+			bitvec_copy_msb(p->output, 0, p->source, p->source_offset, p->source_bits);
+		} else if (p->source != NULL) {
+			bitvec_copy(p->output, 0, p->source, p->source_offset, p->source_bits);
+		} else if (p->output != NULL && p->msb) {
+			/* MSB first, TDO bits enter the FTDI's shift register from the
+			 * bottom. The TMS command always reads LSB first. */
+			uint8_t byte_in = 0;
+			if (p->bits > 0)
+				byte_in = p->rx[0] << (8 - p->bits);
+			if (p->tms)
+				byte_in |= (p->rx[1] >> 7) << (7 - p->bits);
+			p->output[0] = byte_in;
+		} else if (p->output != NULL) {
+			/* TDO bits enter the FTDI's shift register from the top, so a
+			 * partial byte ends up in its upper bits. */
+			uint8_t byte_in = 0;
+			if (p->bits > 0)
+				byte_in = p->rx[0] >> (8 - p->bits);
+			if (p->tms)
+				byte_in |= (p->rx[1] >> 7) << p->bits;
+			p->output[0] = byte_in;
+		}
+
+		if (p->callback != NULL)
+			p->callback(p->arg);
+	}
+	jtag->pending_count = 0;
+
+	return status;
+}
 
-uint8_t jtag_current_state(void)
+/* Reserves the next result slot, running the queue first if it is full */
+static struct jtag_pending *jtag_pending_add(struct jtag_ctx *jtag)
 {
-	return current_state;
+	if (jtag->pending_count == JTAG_QUEUE_DEPTH) {
+		int status = jtag_flush(jtag);
+		if (status != MPSSE_OK)
+			jtag->queue_status = status;
+	}
+
+	struct jtag_pending *p = &jtag->pending[jtag->pending_count++];
+	memset(p, 0, sizeof(*p));
+	return p;
 }
 
-void jtag_set_current_state(uint8_t state)
+void jtag_queue_callback(struct jtag_ctx *jtag, jtag_callback_t callback, void *arg)
 {
-	current_state = state;
+	struct jtag_pending *p = jtag_pending_add(jtag);
+	p->callback = callback;
+	p->arg = arg;
+}
+
+void jtag_set_clkdiv(struct jtag_ctx *jtag, enum jtag_phase phase, unsigned clkdiv){
+	jtag->clkdiv[phase] = clkdiv;
+	if (phase == jtag->phase)
+		mpsse_set_clkdiv(jtag->mpsse, clkdiv);
+}
+
+unsigned jtag_get_clkdiv(struct jtag_ctx *jtag, enum jtag_phase phase){
+	return jtag->clkdiv[phase];
 }
 
-void jtag_error(int status){
-	mpsse_error(status);
+void jtag_set_phase(struct jtag_ctx *jtag, enum jtag_phase phase){
+	/* The divider change is queued like any other command, it takes effect
+	 * between two shifts without draining the pipeline. */
+	if (jtag->clkdiv[phase] != mpsse_get_clkdiv(jtag->mpsse))
+		mpsse_set_clkdiv(jtag->mpsse, jtag->clkdiv[phase]);
+	jtag->phase = phase;
 }
 
-void jtag_deinit(){
-	mpsse_close();
+unsigned jtag_transfer_size(struct jtag_ctx *jtag){
+	/* Every jtag_tap_shift() ends by draining the pipeline, amortize that
+	 * over filling each command buffer a few times. */
+	return 4 * MPSSE_XFER_SLOTS * mpsse_max_shift_bytes(jtag->mpsse);
 }
 
 /**
  * Performs any start-of-day tasks necessary to talk JTAG to our FPGA.
  */
-void jtag_init(int ifnum, const char *devstr, int clkdiv)
+struct jtag_ctx *jtag_init(int ifnum, const char *devstr, int clkdiv)
 {
-	mpsse_init(ifnum, devstr, clkdiv);
+	struct jtag_ctx *jtag = calloc(1, sizeof(*jtag));
+	if (jtag == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(2);
+	}
 
-	jtag_set_current_state(STATE_TEST_LOGIC_RESET);
-	jtag_go_to_state(STATE_TEST_LOGIC_RESET);
-}
+	jtag->mpsse = mpsse_init(ifnum, devstr, clkdiv);
+	jtag->clkdiv[JTAG_PHASE_CONTROL] = clkdiv;
+	jtag->clkdiv[JTAG_PHASE_BULK] = clkdiv;
+	jtag->phase = JTAG_PHASE_CONTROL;
+
+	jtag_set_current_state(jtag, STATE_TEST_LOGIC_RESET);
+	jtag_go_to_state(jtag, STATE_TEST_LOGIC_RESET);
 
-uint8_t data[32*1024];
-uint8_t* ptr;
-uint16_t rx_cnt;
+	return jtag;
+}
 
-extern struct ftdi_context mpsse_ftdic;
+/* Room for assembling a scan of the given number of bits */
+static uint8_t *jtag_fold_buffer(struct jtag_ctx *jtag, uint32_t bits)
+{
+	size_t size = (bits + 7) / 8;
+	if (size > jtag->fold_size) {
+		uint8_t *fold = realloc(jtag->fold, size);
+		if (fold == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			jtag_error(jtag, 2);
+		}
+		jtag->fold = fold;
+		jtag->fold_size = size;
+	}
+	return jtag->fold;
+}
 
-static inline void jtag_pulse_clock_and_read_tdo(bool tms, bool tdi)
+/* Room for the TDO data of a scan until the next flush. The arena is only
+ * reused once nothing refers to it any more, i.e. nothing is pending. */
+static uint8_t *jtag_arena_alloc(struct jtag_ctx *jtag, uint32_t bits)
 {
-  *ptr++ = MC_DATA_TMS | MC_DATA_IN | MC_DATA_LSB | MC_DATA_BITS | MC_DATA_OCN | MC_DATA_ICN;
-	*ptr++ =  0;        
-	*ptr++ = (tdi ? 0x80 : 0) | (tms ? 0x01 : 0);
-	rx_cnt++;
+	size_t size = (bits + 7) / 8;
+
+	if (jtag->pending_count == 0)
+		jtag->arena_used = 0;
+	if (jtag->arena_used + size > jtag->arena_size && jtag->arena_used > 0) {
+		int status = jtag_flush(jtag);
+		if (status != MPSSE_OK)
+			jtag->queue_status = status;
+		jtag->arena_used = 0;
+	}
+	if (size > jtag->arena_size) {
+		uint8_t *arena = realloc(jtag->arena, size);
+		if (arena == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			jtag_error(jtag, 2);
+		}
+		jtag->arena = arena;
+		jtag->arena_size = size;
+	}
+
+	uint8_t *p = jtag->arena + jtag->arena_used;
+	jtag->arena_used += size;
+	return p;
 }
 
+/* Shifts the last 1-8 bits of a scan: up to 7 bits in one bit mode data
+ * command, and with must_end the final bit in a TMS command that leaves the
+ * shift state on the same clock. With msb the bits are taken from the top
+ * of the byte down. */
 static void _jtag_tap_shift(
-	uint8_t *input_data,
+	struct jtag_ctx *jtag,
+	const uint8_t *input_data,
 	uint8_t *output_data,
 	uint32_t data_bits,
-	bool must_end)
+	bool must_end,
+	bool msb)
 {
+	uint8_t byte_out = input_data ? input_data[0] : 0;
+	uint8_t data_count = data_bits - must_end;
 
-	//printf("_jtag_tap_shift(0x%08x,0x%08x,%u,%s);\n",input_data, output_data, data_bits, must_end ? "true" : "false");
-	uint32_t bit_count = data_bits;
-	uint32_t byte_count = (data_bits + 7) / 8;
-	rx_cnt = 0;
-	ptr = data;
-
-	for (uint32_t i = 0; i < byte_count; ++i) {
-		uint8_t byte_out = input_data[i];
-		for (int j = 0; j < 8 && bit_count-- > 0; ++j) {
-			bool tms = false;
-			if (bit_count == 0 && must_end) {
-				tms = true;
-				jtag_state_ack(1);
-			}
-			jtag_pulse_clock_and_read_tdo(tms, byte_out & 1);
-			byte_out >>= 1;
-		}
+	/* The level the last bit leaves TDI at, kept without input_data */
+	if (input_data)
+		jtag->tdi = msb ? (byte_out >> (8 - data_bits)) & 1 : (byte_out >> (data_bits - 1)) & 1;
+
+	/* Only ask for TDO data, and only send TDI data, that is wanted */
+	uint8_t direction = (input_data ? MC_DATA_OUT : 0) | (output_data ? MC_DATA_IN : 0);
+	uint8_t order = msb ? 0 : MC_DATA_LSB;
+
+	/* The replies are unpacked by jtag_flush() once they have arrived */
+	struct jtag_pending *p = NULL;
+	if (output_data != NULL) {
+		p = jtag_pending_add(jtag);
+		p->output = output_data;
+		p->bits = data_count;
+		p->tms = must_end;
+		p->msb = msb;
 	}
 
-	mpsse_xfer(data, ptr-data, rx_cnt);
-	
-	/* Data out from the FTDI is actually from an internal shift register
-	 * Instead of reconstructing the bitpattern, we can just take every 8th byte.*/
-	for(int i = 0; i < rx_cnt/8; i++)
-		output_data[i] = data[7+i*8];
-}
+	if (data_count > 0 && direction != 0) {
+		uint8_t *buffer = mpsse_queue(jtag->mpsse, input_data ? 3 : 2, p ? &p->rx[0] : NULL, p ? 1 : 0);
+		buffer[0] = direction | order | MC_DATA_BITS | MC_DATA_OCN | MC_DATA_ICN;
+		buffer[1] = data_count - 1;
+		if (input_data)
+			buffer[2] = byte_out;
+	} else if (data_count > 0) {
+		/* Neither direction, just the clocks */
+		jtag_run_clocks(jtag, data_count);
+	}
 
+	if (must_end) {
+		/* TDI is held at bit 7 of the TMS command for the whole clock */
+		uint8_t *buffer = mpsse_queue(jtag->mpsse, 3, p ? &p->rx[1] : NULL, p ? 1 : 0);
+		buffer[0] = MC_DATA_TMS | (p ? MC_DATA_IN : 0) | MC_DATA_LSB | MC_DATA_BITS | MC_DATA_OCN | MC_DATA_ICN;
+		buffer[1] = 0;
+		buffer[2] = (jtag->tdi ? 0x80 : 0) | 0x01;
+		jtag_state_ack(jtag, 1);
+	}
+}
 
+/* Shifts whole bytes. Without input_data TDI is left where it is and no
+ * data is sent, without output_data no TDO data comes back. */
 static void jtag_shift_bytes(
-	uint8_t *input_data,
+	struct jtag_ctx *jtag,
+	const uint8_t *input_data,
 	uint8_t *output_data,
 	uint32_t data_bits,
-	bool must_end)
+	bool must_end,
+	bool msb)
 {
 
 	/* Sanity check */
@@ -200,108 +367,712 @@ static void jtag_shift_bytes(
 	}
 	//printf("jtag_shift_bytes(0x%08x,0x%08x,%u,%s);\n",input_data, output_data, data_bits, must_end ? "true" : "false");
 	uint32_t byte_count = data_bits / 8;
-	data[0] = MC_DATA_OUT | MC_DATA_IN | MC_DATA_LSB | MC_DATA_OCN | MC_DATA_ICN;
-	data[1] = (byte_count - 1); 
-	data[2] = (byte_count - 1) >> 8;        
-	memcpy(data + 3, input_data, byte_count);
+	uint32_t send_count = input_data ? byte_count : 0;
+	uint32_t receive_count = output_data ? byte_count : 0;
+
+	if (input_data == NULL && output_data == NULL) {
+		/* Nothing to send or receive, just the clocks */
+		jtag_run_clocks(jtag, data_bits);
+		return;
+	}
 
-	mpsse_xfer(data, byte_count + 3, byte_count);
+	uint8_t* buffer = mpsse_queue(jtag->mpsse, send_count + 3, output_data, receive_count);
+	buffer[0] = (input_data ? MC_DATA_OUT : 0) | (output_data ? MC_DATA_IN : 0) | (msb ? 0 : MC_DATA_LSB) | MC_DATA_OCN | MC_DATA_ICN;
+	buffer[1] = (byte_count - 1); 
+	buffer[2] = (byte_count - 1) >> 8;        
+	if (input_data) {
+		memcpy(buffer + 3, input_data, byte_count);
+		jtag->tdi = msb ? input_data[byte_count - 1] & 1 : input_data[byte_count - 1] >> 7;
+	}
 
-	memcpy(output_data, data, byte_count);
+	/* TDO data lands directly in output_data once this command has been
+	 * flushed, the input has already been copied so they may overlap. */
 }
 
 #ifndef MIN
 	#define MIN(a,b) ((a) < (b)) ? (a) : (b)
 #endif
 
-void jtag_tap_shift(
-	uint8_t *input_data,
+static void jtag_queue_raw(
+	struct jtag_ctx *jtag,
+	const uint8_t *input_data,
 	uint8_t *output_data,
 	uint32_t data_bits,
-	bool must_end)
+	bool must_end,
+	bool msb)
 {
+	jtag->scan_start = false;
+
 	/* if 'must_end' the send last byte seperately 
 	 * This way we toggle TMS on the last clock cycle */
 
 	while (data_bits >= (8 + must_end)) {
-		uint32_t _data_bits = MIN(4096 + 2048, data_bits - must_end) & ~7U;
+		uint32_t _data_bits = MIN(mpsse_max_shift_bytes(jtag->mpsse) * 8, data_bits - must_end) & ~7U;
 
 		jtag_shift_bytes(
+			jtag,
 			input_data,
 			output_data,
 			_data_bits,
-			false
+			false,
+			msb
 		);
 
 		data_bits   -= _data_bits;
-		input_data  += _data_bits / 8;
-		output_data += _data_bits / 8;
+		if (input_data != NULL)
+			input_data  += _data_bits / 8;
+		if (output_data != NULL)
+			output_data += _data_bits / 8;
 	}
 
 	if (data_bits > 0) {
 		_jtag_tap_shift(
+			jtag,
 			input_data,
 			output_data,
 			data_bits,
-			must_end
+			must_end,
+			msb
 		);
 	}
 }
 
-void jtag_state_ack(bool tms)
+/* Has jtag_flush() copy the payload of a folded scan from the arena */
+static void jtag_queue_extract(struct jtag_ctx *jtag, const uint8_t *source, uint32_t offset, uint8_t *output_data, uint32_t data_bits, bool msb)
+{
+	struct jtag_pending *p = jtag_pending_add(jtag);
+	p->output = output_data;
+	p->source = source;
+	p->source_offset = offset;
+	p->source_bits = data_bits;
+	p->msb = msb;
+}
+
+/* Shifts bits copies of the fill bit, BYPASS bits or padding. The TDO
+ * data goes to output_data unless that is NULL. */
+static void jtag_queue_fill(struct jtag_ctx *jtag, uint8_t fill, uint8_t *output_data, uint32_t bits, bool must_end, bool msb)
+{
+	uint8_t buffer[64];
+	memset(buffer, fill, sizeof(buffer));
+
+	while (bits > sizeof(buffer) * 8) {
+		jtag_queue_raw(jtag, buffer, output_data, sizeof(buffer) * 8, false, msb);
+		bits -= sizeof(buffer) * 8;
+		if (output_data != NULL)
+			output_data += sizeof(buffer);
+	}
+	jtag_queue_raw(jtag, buffer, output_data, bits, must_end, msb);
+}
+
+/* Shifts the segments back to back, must_end applies to the last bit */
+static void jtag_queue_pieces(struct jtag_ctx *jtag, const struct jtag_segment *segments, unsigned count, bool must_end, bool msb)
+{
+	while (count > 0 && segments[count - 1].bits == 0)
+		count--;
+
+	for (unsigned i = 0; i < count; i++)
+		jtag_queue_raw(jtag, segments[i].input, segments[i].output, segments[i].bits, must_end && i == count - 1, msb);
+}
+
+static void jtag_queue_scan(
+	struct jtag_ctx *jtag,
+	const struct jtag_segment *segments,
+	unsigned count,
+	bool must_end,
+	bool msb)
+{
+	unsigned header = 0, trailer = 0;
+	uint8_t fill = 0x00;
+
+	if (jtag->selected && jtag->current_state == STATE_SHIFT_IR) {
+		/* All ones is BYPASS for every device */
+		header = jtag->ir_header;
+		trailer = jtag->ir_trailer;
+		fill = 0xff;
+	} else if (jtag->selected && jtag->current_state == STATE_SHIFT_DR) {
+		header = jtag->dr_header;
+		trailer = jtag->dr_trailer;
+	}
+	if (!jtag->scan_start)
+		header = 0;
+	if (!must_end)
+		trailer = 0;
+
+	/* The BYPASS bits go out on their own. The devices between the target
+	 * and TDO hold the header bits when it is done, so the target's own
+	 * bits come out in step with the ones going in. */
+	if (header > 0)
+		jtag_queue_fill(jtag, fill, NULL, header, false, false);
+	jtag_queue_pieces(jtag, segments, count, must_end && trailer == 0, msb);
+	if (trailer > 0)
+		jtag_queue_fill(jtag, fill, NULL, trailer, true, false);
+}
+
+void jtag_queue_segments(
+	struct jtag_ctx *jtag,
+	const struct jtag_segment *segments,
+	unsigned count,
+	bool must_end)
+{
+	jtag_queue_scan(jtag, segments, count, must_end, false);
+}
+
+void jtag_queue_shift(
+	struct jtag_ctx *jtag,
+	const uint8_t *input_data,
+	uint8_t *output_data,
+	uint32_t data_bits,
+	bool must_end)
+{
+	struct jtag_segment segment = { input_data, output_data, data_bits };
+	jtag_queue_scan(jtag, &segment, 1, must_end, false);
+}
+
+void jtag_queue_shift_msb(
+	struct jtag_ctx *jtag,
+	const uint8_t *input_data,
+	uint8_t *output_data,
+	uint32_t data_bits,
+	bool must_end)
+{
+	struct jtag_segment segment = { input_data, output_data, data_bits };
+	jtag_queue_scan(jtag, &segment, 1, must_end, true);
+}
+
+void jtag_queue_stream_segments(
+	struct jtag_ctx *jtag,
+	const struct jtag_segment *segments,
+	unsigned count,
+	bool must_end)
+{
+	unsigned before = jtag->selected ? jtag->dr_header : 0;
+	unsigned after = jtag->selected ? jtag->dr_trailer : 0;
+	bool start = jtag->current_state != STATE_SHIFT_DR;
+
+	if (start)
+		jtag_go_to_state(jtag, STATE_SHIFT_DR);
+
+	if (before == 0 && after == 0) {
+		jtag_queue_pieces(jtag, segments, count, must_end, true);
+		return;
+	}
+
+	uint32_t data_bits = 0;
+	bool output = false, aligned = true;
+	for (unsigned i = 0; i < count; i++) {
+		data_bits += segments[i].bits;
+		output |= segments[i].output != NULL;
+		aligned &= segments[i].bits % 8 == 0;
+	}
+
+	if (output && !must_end) {
+		fprintf(stderr, "JTAG: can't read a stream back before it ends on a chain\n");
+		jtag_error(jtag, 2);
+	}
+
+	/* The 'after' devices between TDI and the target delay its input: at the
+	 * end, that many more bits push the last of the data through. Its output
+	 * then needs 'before' more to get past the devices towards TDO. */
+	uint32_t pad = must_end ? after + (output ? before : 0) : 0;
+	uint32_t preload = start ? after : 0;
+	uint32_t offset = (start ? 0 : after) + before;
+
+	if (preload == 0 && (!output || aligned)) {
+		/* The data goes out as it is, and the TDO data of byte sized
+		 * segments lines up in the arena to be cut out from there */
+		uint8_t *raw = output ? jtag_arena_alloc(jtag, data_bits + pad) : NULL;
+		uint32_t position = 0;
+
+		for (unsigned i = 0; i < count; i++) {
+			const struct jtag_segment *s = &segments[i];
+			position += s->bits;
+			jtag_queue_raw(jtag, s->input, raw ? raw + (position - s->bits) / 8 : NULL,
+				s->bits, must_end && pad == 0 && position == data_bits, true);
+		}
+		if (pad > 0)
+			jtag_queue_fill(jtag, 0x00, raw ? raw + data_bits / 8 : NULL, pad, must_end, true);
+
+		position = 0;
+		for (unsigned i = 0; i < count; i++) {
+			if (segments[i].output != NULL)
+				jtag_queue_extract(jtag, raw, offset + position, segments[i].output, segments[i].bits, true);
+			position += segments[i].bits;
+		}
+		return;
+	}
+
+	/* Otherwise the segments are put together first. That is only needed
+	 * at the start of a stream, or for reads with odd bit counts. The arena
+	 * keeps them until they are in the queue. */
+	uint8_t *input_data = jtag_arena_alloc(jtag, data_bits);
+	uint32_t position = 0;
+	memset(input_data, 0, (data_bits + 7) / 8);
+	for (unsigned i = 0; i < count; i++) {
+		if (segments[i].input != NULL)
+			bitvec_copy_msb(input_data, position, segments[i].input, 0, segments[i].bits);
+		position += segments[i].bits;
+	}
+
+	uint32_t total = data_bits + pad;
+	if (total < preload)
+		total = preload;
+
+	uint8_t *fold = jtag_fold_buffer(jtag, total);
+
+	if (preload > 0) {
+		/* Leave the first bits in the BYPASS registers in front of the
+		 * target, and come back through PAUSE-DR: that skips Capture-DR,
+		 * so they are the first the target sees once in SHIFT-DR again.
+		 * What it got so far were captured BYPASS bits, and on the ECP5
+		 * leaving SHIFT-DR deselects the flash, which drops them. */
+		memset(fold, 0, (preload + 7) / 8);
+		bitvec_copy_msb(fold, 0, input_data, 0, data_bits < preload ? data_bits : preload);
+		jtag_queue_raw(jtag, fold, NULL, preload, true, true);
+		jtag_go_to_state(jtag, STATE_SHIFT_DR);
+	}
+
+	uint32_t rest = total - preload;
+	memset(fold, 0, (rest + 7) / 8);
+	if (data_bits > preload)
+		bitvec_copy_msb(fold, 0, input_data, preload, data_bits - preload);
+
+	uint8_t *raw = output ? jtag_arena_alloc(jtag, rest) : NULL;
+	jtag_queue_raw(jtag, fold, raw, rest, must_end, true);
+
+	position = 0;
+	for (unsigned i = 0; i < count && raw != NULL; i++) {
+		if (segments[i].output != NULL)
+			jtag_queue_extract(jtag, raw, offset + position, segments[i].output, segments[i].bits, true);
+		position += segments[i].bits;
+	}
+}
+
+void jtag_queue_stream(
+	struct jtag_ctx *jtag,
+	const uint8_t *input_data,
+	uint8_t *output_data,
+	uint32_t data_bits,
+	bool must_end)
+{
+	struct jtag_segment segment = { input_data, output_data, data_bits };
+	jtag_queue_stream_segments(jtag, &segment, 1, must_end);
+}
+
+int jtag_tap_shift(
+	struct jtag_ctx *jtag,
+	uint8_t *input_data,
+	uint8_t *output_data,
+	uint32_t data_bits,
+	bool must_end)
+{
+	jtag_queue_shift(jtag, input_data, output_data, data_bits, must_end);
+
+	/* The caller expects its TDO data on return */
+	return jtag_flush(jtag);
+}
+
+static void jtag_state_ack(struct jtag_ctx *jtag, bool tms)
 {
 	if (tms) {
-		jtag_set_current_state((tms_transitions[jtag_current_state()] >> 4) & 0xf);
+		jtag_set_current_state(jtag, (tms_transitions[jtag_current_state(jtag)] >> 4) & 0xf);
 	} else {
-		jtag_set_current_state(tms_transitions[jtag_current_state()] & 0xf);
+		jtag_set_current_state(jtag, tms_transitions[jtag_current_state(jtag)] & 0xf);
 	}
 }
 
-void jtag_go_to_state(unsigned state)
+void jtag_go_to_state(struct jtag_ctx *jtag, unsigned state)
 {
+	uint8_t tms;
+	uint8_t count;
 
 	if (state == STATE_TEST_LOGIC_RESET) {
-		for (int i = 0; i < 5; ++i) {
-			jtag_state_ack(true);
+		/* Five clocks with TMS high get there from any state, even if we
+		 * lost track of where the TAP is */
+		tms = 0b11111;
+		count = 5;
+	} else {
+		tms = tms_paths[jtag_current_state(jtag)][state] & 0xff;
+		count = tms_paths[jtag_current_state(jtag)][state] >> 8;
+	}
+
+	/* Resuming from a pause continues the scan, anything else captures */
+	if (state == STATE_SHIFT_DR && count > 0)
+		jtag->scan_start = !(jtag_current_state(jtag) >= STATE_EXIT1_DR && jtag_current_state(jtag) <= STATE_EXIT2_DR);
+	if (state == STATE_SHIFT_IR && count > 0)
+		jtag->scan_start = !(jtag_current_state(jtag) >= STATE_EXIT1_IR && jtag_current_state(jtag) <= STATE_EXIT2_IR);
+
+	/* One TMS command clocks at most 7 bits */
+	while (count > 0) {
+		uint8_t bits = MIN(count, 7);
+		uint8_t *buffer = mpsse_queue(jtag->mpsse, 3, NULL, 0);
+		buffer[0] = MC_DATA_TMS | MC_DATA_LSB | MC_DATA_ICN | MC_DATA_BITS;
+		buffer[1] = bits - 1;
+		buffer[2] = (jtag->tdi ? 0x80 : 0) | (tms & 0x7f);
+
+		tms >>= bits;
+		count -= bits;
+	}
+
+	jtag_set_current_state(jtag, state);
+}
+
+void jtag_wait_time(struct jtag_ctx *jtag, uint32_t microseconds)
+{
+	/* Rounded up, so a wait is never shorter than asked for */
+	uint64_t hz = mpsse_tck_hz(jtag->mpsse, mpsse_get_clkdiv(jtag->mpsse));
+	jtag_run_clocks(jtag, (microseconds * hz + 999999) / 1000000);
+}
+
+void jtag_run_clocks(struct jtag_ctx *jtag, uint64_t clocks)
+{
+	if (!mpsse_has_clk_n(jtag->mpsse)) {
+		/* The FT2232D has no clock-only commands, shift out TDI data at
+		 * the level TDI is at instead. TMS and TDI unchanged. */
+		uint8_t fill = jtag->tdi ? 0xff : 0x00;
+		uint32_t max_bytes = mpsse_max_shift_bytes(jtag->mpsse);
+		while (clocks >= 8) {
+			uint32_t bytes = MIN(clocks / 8, max_bytes);
+			uint8_t *buffer = mpsse_queue(jtag->mpsse, bytes + 3, NULL, 0);
+			buffer[0] = MC_DATA_OUT | MC_DATA_LSB | MC_DATA_OCN;
+			buffer[1] = (bytes - 1);
+			buffer[2] = (bytes - 1) >> 8;
+			memset(buffer + 3, fill, bytes);
+			clocks -= bytes * 8;
 		}
 
-		uint8_t data[3] = { 
-			MC_DATA_TMS | MC_DATA_LSB | MC_DATA_BITS | MC_DATA_ICN,
-			5 - 1,
-			0b11111
-		};
-		mpsse_xfer(data, 3, 0);
-		
-	} else {
-		while (jtag_current_state() != state) {
-			uint8_t data[3] = {
-				MC_DATA_TMS | MC_DATA_LSB | MC_DATA_ICN | MC_DATA_BITS,
-				0,
-				(tms_map[jtag_current_state()] >> state) & 1
-			};
-
-			jtag_state_ack((tms_map[jtag_current_state()] >> state) & 1);
-			mpsse_xfer(data, 3, 0);
+		if (clocks > 0) {
+			uint8_t *buffer = mpsse_queue(jtag->mpsse, 3, NULL, 0);
+			buffer[0] = MC_DATA_OUT | MC_DATA_LSB | MC_DATA_BITS | MC_DATA_OCN;
+			buffer[1] = clocks - 1;
+			buffer[2] = fill;
+		}
+		return;
+	}
+
+	/* Up to 65536 bytes worth of clocks per command, TMS and TDI unchanged */
+	while (clocks >= 8) {
+		uint32_t bytes = MIN(clocks / 8, 0x10000);
+		uint8_t *buffer = mpsse_queue(jtag->mpsse, 3, NULL, 0);
+		buffer[0] = MC_CLK_N8;
+		buffer[1] = (bytes - 1);
+		buffer[2] = (bytes - 1) >> 8;
+		clocks -= bytes * 8;
+	}
+
+	if (clocks > 0) {
+		uint8_t *buffer = mpsse_queue(jtag->mpsse, 2, NULL, 0);
+		buffer[0] = MC_CLK_N;
+		buffer[1] = clocks - 1;
+	}
+}
+
+
+// ---------------------------------------------------------
+// TCK speed training
+// ---------------------------------------------------------
+
+#define TRAIN_BYPASS_BITS 2048
+#define TRAIN_ROUNDS      4
+
+/* Enough to fill the instruction registers of a full chain */
+#define CHAIN_IR_BITS (JTAG_MAX_DEVICES * 32)
+
+static int chain_ir_total(struct jtag_ctx *jtag, uint8_t *captured);
+
+/* Dividers tried by jtag_train_clock(), fastest first */
+static const uint16_t train_dividers[] = { 1, 2, 3, 4, 5, 6, 8, 10, 12, 15, 20, 30 };
+
+static uint32_t train_random(uint32_t *state)
+{
+	/* xorshift32, the workers of a gang each keep their own state */
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static inline int train_bit(const uint8_t *data, unsigned bit)
+{
+	return (data[bit / 8] >> (bit % 8)) & 1;
+}
+
+/* The DR after Test-Logic-Reset holds the IDCODE, whatever the devices are */
+static uint32_t train_read_idcode(struct jtag_ctx *jtag)
+{
+	uint8_t data[4] = { 0 };
+
+	jtag_go_to_state(jtag, STATE_TEST_LOGIC_RESET);
+	jtag_go_to_state(jtag, STATE_SHIFT_DR);
+	jtag_tap_shift(jtag, data, data, 32, true);
+
+	return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+/* Put every device in BYPASS, with ir_bits ones for all the instruction
+ * registers, and shift random bits through the chain. Returns the bit
+ * errors, with a delay of 'delay' bits between TDI and TDO. */
+static unsigned train_bypass(struct jtag_ctx *jtag, unsigned ir_bits, unsigned delay, uint32_t *seed)
+{
+	uint8_t ir[CHAIN_IR_BITS / 8];
+	uint8_t in[TRAIN_BYPASS_BITS / 8], out[TRAIN_BYPASS_BITS / 8];
+	unsigned errors = 0;
+
+	memset(ir, 0xff, sizeof(ir));
+	jtag_go_to_state(jtag, STATE_SHIFT_IR);
+	jtag_tap_shift(jtag, ir, NULL, ir_bits, true);
+
+	for (int i = 0; i < sizeof(in); i++)
+		in[i] = train_random(seed);
+	jtag_go_to_state(jtag, STATE_SHIFT_DR);
+	jtag_tap_shift(jtag, in, out, TRAIN_BYPASS_BITS, true);
+
+	for (unsigned bit = 0; bit + delay < TRAIN_BYPASS_BITS; bit++)
+		errors += train_bit(in, bit) != train_bit(out, bit + delay);
+
+	return errors;
+}
+
+/* Bit errors over a few rounds of IDCODE reads and BYPASS loopbacks */
+static unsigned train_errors(struct jtag_ctx *jtag, uint32_t idcode, unsigned ir_bits, unsigned delay, uint32_t *seed)
+{
+	unsigned errors = 0;
+
+	for (int round = 0; round < TRAIN_ROUNDS; round++) {
+		errors += __builtin_popcount(train_read_idcode(jtag) ^ idcode);
+		errors += train_bypass(jtag, ir_bits, delay, seed);
+	}
+
+	return errors;
+}
+
+unsigned jtag_train_clock(struct jtag_ctx *jtag)
+{
+	uint32_t seed = 0x2545f491;
+	unsigned reference = jtag->clkdiv[JTAG_PHASE_CONTROL];
+
+	jtag_set_phase(jtag, JTAG_PHASE_CONTROL);
+
+	/* Training scans the whole chain, without the BYPASS bits that go
+	 * around a selected device */
+	bool selected = jtag->selected;
+	jtag->selected = false;
+
+	/* Learn the IDCODE, the IR length and the length of the BYPASS chain at
+	 * the clock the session was opened with, which is assumed to be safe. */
+	uint32_t idcode = train_read_idcode(jtag);
+
+	uint8_t captured[CHAIN_IR_BITS * 2 / 8];
+	int ir_bits = chain_ir_total(jtag, captured);
+	if (ir_bits <= 0)
+		ir_bits = CHAIN_IR_BITS;
+
+	unsigned delay;
+	for (delay = 0; delay <= 32; delay++) {
+		uint32_t probe_seed = seed;
+		if (train_bypass(jtag, ir_bits, delay, &probe_seed) == 0)
+			break;
+	}
+
+	if (delay > 32 || idcode == 0 || idcode == 0xffffffff) {
+		fprintf(stderr, "TCK training: no response from the JTAG chain, keeping divider %u\n", reference);
+		jtag_go_to_state(jtag, STATE_TEST_LOGIC_RESET);
+		jtag->selected = selected;
+		return reference;
+	}
+
+	/* Find the fastest clock that passes without a single bit error */
+	unsigned fastest = reference;
+	for (int i = 0; i < sizeof(train_dividers) / sizeof(train_dividers[0]); i++) {
+		if (train_dividers[i] >= reference)
+			break;
+
+		mpsse_set_clkdiv(jtag->mpsse, train_dividers[i]);
+		if (train_errors(jtag, idcode, ir_bits, delay, &seed) == 0) {
+			fastest = train_dividers[i];
+			break;
 		}
 	}
+
+	/* Back off by 25% for margin, and make sure that still passes */
+	unsigned clkdiv = (fastest * 5 + 3) / 4;
+	if (clkdiv > reference)
+		clkdiv = reference;
+	mpsse_set_clkdiv(jtag->mpsse, clkdiv);
+	if (train_errors(jtag, idcode, ir_bits, delay, &seed) != 0)
+		clkdiv = reference;
+
+	mpsse_set_clkdiv(jtag->mpsse, reference);
+	jtag_go_to_state(jtag, STATE_TEST_LOGIC_RESET);
+	jtag->selected = selected;
+	return clkdiv;
 }
 
-void jtag_wait_time(uint32_t microseconds)
+unsigned jtag_tck_hz(struct jtag_ctx *jtag, enum jtag_phase phase)
 {
-	uint16_t bytes = microseconds / 8;
-	uint8_t remain = microseconds % 8;
+	return mpsse_tck_hz(jtag->mpsse, jtag->clkdiv[phase]);
+}
+
+
+// ---------------------------------------------------------
+// Chain discovery
+// ---------------------------------------------------------
+
+static inline int chain_bit(const uint8_t *data, unsigned bit)
+{
+	return (data[bit / 8] >> (bit % 8)) & 1;
+}
+
+/* Splits the captured IR values, total bits of them, into the devices.
+ * Every IR captures xx..x01, so an unknown device ends where the next 1
+ * followed by a 0 starts, unless it is the only unknown one. */
+static bool chain_split_ir(struct jtag_ctx *jtag, const uint8_t *captured, unsigned total, jtag_ir_length_t ir_length)
+{
+	unsigned known = 0, unknown = 0;
 
-	uint8_t data[3] = {
-		MC_CLK_N8,
-		bytes & 0xFF,
-		(bytes >> 8) & 0xFF
-	};
-	mpsse_xfer(data, 3, 0);
+	for (unsigned i = 0; i < jtag->device_count; i++) {
+		struct jtag_device *dev = &jtag->devices[i];
+		dev->ir_length = (ir_length && dev->idcode) ? ir_length(dev->idcode) : 0;
+		if (dev->ir_length)
+			known += dev->ir_length;
+		else
+			unknown++;
+	}
+
+	unsigned pos = 0;
+	for (unsigned i = 0; i < jtag->device_count; i++) {
+		struct jtag_device *dev = &jtag->devices[i];
+
+		if (dev->ir_length == 0 && unknown == 1) {
+			dev->ir_length = total > known ? total - known : 0;
+		} else if (dev->ir_length == 0) {
+			unsigned end = pos + 2;
+			if (i == jtag->device_count - 1)
+				end = total;
+			while (end + 1 < total && !(chain_bit(captured, end) && !chain_bit(captured, end + 1)))
+				end++;
+			dev->ir_length = end - pos;
+		}
 
-	if(remain){
-		data[0] = MC_CLK_N;
-		data[1] = remain;
-		mpsse_xfer(data, 2, 0);
+		if (dev->ir_length < 2 || pos + dev->ir_length > total ||
+		    !chain_bit(captured, pos) || chain_bit(captured, pos + 1)) {
+			fprintf(stderr, "JTAG: can't work out the IR length of device %u\n", i);
+			return false;
+		}
+		pos += dev->ir_length;
+	}
+
+	if (pos != total) {
+		fprintf(stderr, "JTAG: IR lengths add up to %u bits, the chain has %u\n", pos, total);
+		return false;
 	}
+	return true;
 }
 
+/* Shifts zeros and then ones through all the instruction registers, the
+ * CHAIN_IR_BITS * 2 bits of TDO data go to captured. The captured IR values
+ * come out first, then the zeros shifted in, then the ones: those take
+ * exactly the total IR length to get through. Every IR holds ones, i.e.
+ * BYPASS, at the end. Returns the total IR length, 0 if the chain is too
+ * long or does not answer, or -1 if the transfer failed. */
+static int chain_ir_total(struct jtag_ctx *jtag, uint8_t *captured)
+{
+	uint8_t ir[CHAIN_IR_BITS * 2 / 8];
+
+	memset(ir, 0x00, sizeof(ir) / 2);
+	memset(ir + sizeof(ir) / 2, 0xff, sizeof(ir) / 2);
+	jtag_go_to_state(jtag, STATE_SHIFT_IR);
+	if (jtag_tap_shift(jtag, ir, captured, sizeof(ir) * 8, true) != MPSSE_OK)
+		return -1;
+	jtag_go_to_state(jtag, STATE_RUN_TEST_IDLE);
+
+	unsigned total = 0;
+	while (total < CHAIN_IR_BITS && !chain_bit(captured, CHAIN_IR_BITS + total))
+		total++;
+	return total < CHAIN_IR_BITS ? total : 0;
+}
+
+int jtag_scan_chain(struct jtag_ctx *jtag, jtag_ir_length_t ir_length)
+{
+	uint8_t dr[(JTAG_MAX_DEVICES + 1) * 4];
+	unsigned count = 0;
+
+	jtag->selected = false;
+	jtag->device_count = 0;
+
+	/* After reset each device has its IDCODE selected, whose LSB is 1, or
+	 * BYPASS, which captures a 0. The ones shifted in behind them read as
+	 * an IDCODE of all ones once the end of the chain has been reached. */
+	memset(dr, 0xff, sizeof(dr));
+	jtag_go_to_state(jtag, STATE_TEST_LOGIC_RESET);
+	jtag_go_to_state(jtag, STATE_SHIFT_DR);
+	if (jtag_tap_shift(jtag, dr, dr, sizeof(dr) * 8, true) != MPSSE_OK)
+		return -1;
+
+	for (unsigned bit = 0; bit < sizeof(dr) * 8; ) {
+		uint32_t idcode = 0;
+		bool bypass = !chain_bit(dr, bit);
+
+		if (!bypass) {
+			if (bit + 32 > sizeof(dr) * 8)
+				break;
+			for (int i = 31; i >= 0; i--)
+				idcode = idcode << 1 | chain_bit(dr, bit + i);
+			if (idcode == 0xffffffff)
+				break;
+		}
+
+		if (count == JTAG_MAX_DEVICES) {
+			count++;
+			break;
+		}
+		jtag->devices[count++] = (struct jtag_device){ .idcode = idcode };
+		bit += bypass ? 1 : 32;
+	}
+
+	if (count == 0 || count > JTAG_MAX_DEVICES) {
+		fprintf(stderr, "JTAG: no devices found on the chain, or more than %d\n", JTAG_MAX_DEVICES);
+		jtag_go_to_state(jtag, STATE_TEST_LOGIC_RESET);
+		return -1;
+	}
+	jtag->device_count = count;
+
+	uint8_t captured[CHAIN_IR_BITS * 2 / 8];
+	int total = chain_ir_total(jtag, captured);
+	if (total < 0)
+		return -1;
+
+	if (total == 0 || !chain_split_ir(jtag, captured, total, ir_length)) {
+		jtag->device_count = 0;
+		jtag_go_to_state(jtag, STATE_TEST_LOGIC_RESET);
+		return -1;
+	}
+
+	return count;
+}
+
+unsigned jtag_device_count(struct jtag_ctx *jtag)
+{
+	return jtag->device_count;
+}
+
+const struct jtag_device *jtag_device(struct jtag_ctx *jtag, unsigned position)
+{
+	return position < jtag->device_count ? &jtag->devices[position] : NULL;
+}
+
+void jtag_select_device(struct jtag_ctx *jtag, unsigned position)
+{
+	jtag->ir_header = 0;
+	jtag->ir_trailer = 0;
+	for (unsigned i = 0; i < jtag->device_count; i++) {
+		if (i < position)
+			jtag->ir_header += jtag->devices[i].ir_length;
+		else if (i > position)
+			jtag->ir_trailer += jtag->devices[i].ir_length;
+	}
+
+	/* One BYPASS bit for each of the others */
+	jtag->dr_header = position;
+	jtag->dr_trailer = jtag->device_count - 1 - position;
+	jtag->selected = true;
+}
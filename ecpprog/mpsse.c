@@ -28,7 +28,10 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #include "mpsse.h"
 
@@ -49,101 +52,545 @@
  * xDBUS7 | CRESET | GPIO
  */
 
-struct ftdi_context mpsse_ftdic;
-bool mpsse_ftdic_open = false;
-bool mpsse_ftdic_latency_set = false;
-unsigned char mpsse_ftdi_latency;
+/* Command queue and asynchronous transfer engine
+ *
+ * Commands are not sent as they are issued, they are appended to the
+ * command buffer of the slot currently being filled. A slot is submitted as
+ * a bulk OUT transfer once it is full, or when mpsse_flush() is called
+ * because a caller needs TDO data back. Up to MPSSE_XFER_SLOTS slots are
+ * kept in flight, so the MPSSE never sits idle while the host waits for
+ * the TDO data of the previous one. Replies are collected strictly in order,
+ * and the number of reply bytes outstanding is capped to the size of the
+ * chip's RX FIFO, so the MPSSE never stalls on a full FIFO while we are
+ * still waiting for an earlier OUT transfer to complete.
+ */
+struct mpsse_rx_segment {
+	uint8_t *buffer;
+	uint16_t length;
+};
+
+struct mpsse_xfer_slot {
+	struct ftdi_transfer_control *tc;
+	uint16_t send_length;
+	uint16_t receive_length;
+	unsigned clkdiv;   /* Divider in effect where the buffer starts */
+	uint64_t done_us;  /* When the MPSSE should be done clocking it out */
+	unsigned segment_count;
+	struct mpsse_rx_segment segments[MPSSE_XFER_SEGMENTS];
+	uint8_t data[MPSSE_XFER_SIZE + 1]; /* + Send Immediate */
+	uint8_t rx_data[MPSSE_RX_FIFO_SIZE];
+};
+
+/* FIFO sizes and MPSSE master clock of the FTDI parts, per channel.
+ * TCK is master_clock / (2 * clkdiv). The FT2232D lacks the clock-only
+ * commands MC_CLK_N and MC_CLK_N8. */
+struct mpsse_chip {
+	enum ftdi_chip_type type;
+	const char *name;
+	unsigned tx_fifo_size;
+	unsigned rx_fifo_size;
+	unsigned master_clock;
+	bool clk_n;
+};
+
+static const struct mpsse_chip mpsse_chips[] = {
+	{ TYPE_2232H, "FT2232H", 4096, 4096, 60000000, true },
+	{ TYPE_4232H, "FT4232H", 2048, 2048, 60000000, true },
+	{ TYPE_232H,  "FT232H",  1024, 1024, 60000000, true },
+	{ TYPE_2232C, "FT2232D",  384,  128, 12000000, false },
+};
+
+/* One FTDI MPSSE channel, everything needed to drive it is kept here so
+ * several adapters or channels can be used from the same process. */
+struct mpsse_ctx {
+	struct ftdi_context *ftdi;
+	bool open;
+	bool latency_set;
+	unsigned char latency;
+	unsigned clkdiv;
+	const struct mpsse_chip *chip;
+	unsigned rx_fifo_size;
+
+	struct mpsse_xfer_slot slots[MPSSE_XFER_SLOTS];
+	struct mpsse_xfer_slot *queue_slot;
+	unsigned xfer_head;
+	unsigned xfer_count;
+	unsigned xfer_rx_pending;
+	uint64_t xfer_done_us;
+	int xfer_status;
+};
+
+/* Fatal errors end the process, unless channels are driven from worker
+ * threads. Then only the failing worker stops, see mpsse_set_thread_abort(). */
+static bool mpsse_abort_thread = false;
 
 
 // ---------------------------------------------------------
 // MPSSE / FTDI function implementations
 // ---------------------------------------------------------
 
-void mpsse_check_rx()
+void mpsse_error(struct mpsse_ctx *ctx, int status)
 {
-	uint8_t cnt = 0;
-	while (1) {
-		uint8_t data;
-		int rc = ftdi_read_data(&mpsse_ftdic, &data, 1);
-		if (rc <= 0)
-			break;
-		fprintf(stderr, "unexpected rx byte: %02X\n", data);
-		cnt++;
+	fprintf(stderr, "ABORT.\n");
+	if (ctx->open) {
+		if (ctx->latency_set)
+			ftdi_set_latency_timer(ctx->ftdi, ctx->latency);
+		ftdi_usb_close(ctx->ftdi);
+	}
+	ftdi_free(ctx->ftdi);
+	free(ctx);
 
-		if(cnt > 32)
-			break;
+	if (mpsse_abort_thread)
+		pthread_exit((void *)(intptr_t)status);
+	exit(status);
+}
+
+void mpsse_set_thread_abort(bool enable)
+{
+	mpsse_abort_thread = enable;
+}
+
+static uint64_t mpsse_time_us(void)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+/* Sleep in the USB event loop until tc completes, or give up on it once the
+ * deadline has passed. Returns the number of bytes transferred. */
+static int mpsse_wait(struct mpsse_ctx *ctx, struct ftdi_transfer_control *tc, uint64_t deadline)
+{
+	while (!tc->completed) {
+		uint64_t now = mpsse_time_us();
+		if (now >= deadline) {
+			struct timeval cancel_timeout = { 0, 100000 };
+			ftdi_transfer_data_cancel(tc, &cancel_timeout);
+			return MPSSE_ERR_TIMEOUT;
+		}
+
+		struct timeval timeout = { (deadline - now) / 1000000, (deadline - now) % 1000000 };
+		int rc = libusb_handle_events_timeout_completed(ctx->ftdi->usb_ctx, &timeout, &tc->completed);
+		if (rc < 0 && rc != LIBUSB_ERROR_INTERRUPTED) {
+			fprintf(stderr, "USB event error (rc=%d)\n", rc);
+			mpsse_error(ctx, 2);
+		}
 	}
+
+	return ftdi_transfer_data_done(tc);
 }
 
-void mpsse_error(int status)
+
+void mpsse_xfer(struct mpsse_ctx *ctx, uint8_t* data_buffer, uint16_t send_length, uint16_t receive_length)
 {
-	//mpsse_check_rx();
-	fprintf(stderr, "ABORT.\n");
-	if (mpsse_ftdic_open) {
-		if (mpsse_ftdic_latency_set)
-			ftdi_set_latency_timer(&mpsse_ftdic, mpsse_ftdi_latency);
-		ftdi_usb_close(&mpsse_ftdic);
+	memcpy(mpsse_queue(ctx, send_length, data_buffer, receive_length), data_buffer, send_length);
+
+	/* Commands without a reply stay queued until someone needs TDO data */
+	if (receive_length && mpsse_flush(ctx) != MPSSE_OK) {
+		fprintf(stderr, "Timeout waiting for FTDI USB device.\n");
+		mpsse_error(ctx, 2);
 	}
-	ftdi_deinit(&mpsse_ftdic);
-	exit(status);
 }
 
-uint8_t mpsse_recv_byte()
+/* Drop everything queued or in flight after the adapter stopped responding,
+ * so the next command starts from an empty pipeline. */
+static void mpsse_xfer_abort(struct mpsse_ctx *ctx)
 {
-	uint8_t data;
-	while (1) {
-		int rc = ftdi_read_data(&mpsse_ftdic, &data, 1);
-		if (rc < 0) {
-			fprintf(stderr, "Read error.\n");
-			mpsse_error(2);
+	struct timeval cancel_timeout = { 0, 100000 };
+
+	while (ctx->xfer_count) {
+		struct mpsse_xfer_slot *slot = &ctx->slots[ctx->xfer_head];
+		if (slot->tc != NULL)
+			ftdi_transfer_data_cancel(slot->tc, &cancel_timeout);
+		ctx->xfer_head = (ctx->xfer_head + 1) % MPSSE_XFER_SLOTS;
+		ctx->xfer_count--;
+	}
+
+	ctx->xfer_rx_pending = 0;
+	ctx->xfer_done_us = 0;
+	ctx->queue_slot = NULL;
+
+	if (ftdi_usb_purge_buffers(ctx->ftdi)) {
+		fprintf(stderr, "Failed to purge buffers on FTDI USB device.\n");
+		mpsse_error(ctx, 2);
+	}
+}
+
+/* Collect the TDO data of the oldest in-flight slot and release it. */
+static void mpsse_xfer_retire(struct mpsse_ctx *ctx)
+{
+	struct mpsse_xfer_slot *slot = &ctx->slots[ctx->xfer_head];
+
+	/* Allow for the time it takes to clock out this buffer and the ones
+	 * before it */
+	uint64_t now = mpsse_time_us();
+	uint64_t deadline = (slot->done_us > now ? slot->done_us : now) + MPSSE_TIMEOUT_MS * 1000;
+
+	if (slot->receive_length) {
+		/* A single reply goes straight to its destination, several replies
+		 * are collected together and then scattered. Replies without a
+		 * destination are dropped. */
+		bool direct = slot->segment_count == 1 && slot->segments[0].buffer != NULL;
+		uint8_t *rx_buffer = direct ? slot->segments[0].buffer : slot->rx_data;
+
+		/* Submit the read before waiting on the write, the OUT transfer may not
+		 * complete until the chip has been able to hand us its reply. */
+		struct ftdi_transfer_control *rx = ftdi_read_data_submit(ctx->ftdi, rx_buffer, slot->receive_length);
+		if (rx == NULL) {
+			fprintf(stderr, "Read submit error [%s]\n", ftdi_get_error_string(ctx->ftdi));
+			mpsse_error(ctx, 2);
 		}
-		if (rc == 1)
-			break;
-		usleep(100);
+
+		int rc = mpsse_wait(ctx, rx, deadline);
+		if (rc == MPSSE_ERR_TIMEOUT) {
+			fprintf(stderr, "Read timeout (%d bytes)\n", slot->receive_length);
+			ctx->xfer_status = MPSSE_ERR_TIMEOUT;
+			mpsse_xfer_abort(ctx);
+			return;
+		}
+		if (rc != slot->receive_length) {
+			fprintf(stderr, "Read error (rc=%d, expected %d)[%s]\n", rc, slot->receive_length, ftdi_get_error_string(ctx->ftdi));
+			mpsse_error(ctx, 2);
+		}
+
+		if (!direct) {
+			uint8_t *p = slot->rx_data;
+			for (unsigned i = 0; i < slot->segment_count; i++) {
+				if (slot->segments[i].buffer != NULL)
+					memcpy(slot->segments[i].buffer, p, slot->segments[i].length);
+				p += slot->segments[i].length;
+			}
+		}
+	}
+
+	int rc = mpsse_wait(ctx, slot->tc, deadline);
+	slot->tc = NULL;
+	if (rc == MPSSE_ERR_TIMEOUT) {
+		fprintf(stderr, "Write timeout (%d bytes)\n", slot->send_length);
+		ctx->xfer_status = MPSSE_ERR_TIMEOUT;
+		mpsse_xfer_abort(ctx);
+		return;
 	}
-	return data;
+	if (rc != slot->send_length) {
+		fprintf(stderr, "Write error (rc=%d, expected %d)[%s]\n", rc, slot->send_length, ftdi_get_error_string(ctx->ftdi));
+		mpsse_error(ctx, 2);
+	}
+
+	ctx->xfer_rx_pending -= slot->receive_length;
+	ctx->xfer_head = (ctx->xfer_head + 1) % MPSSE_XFER_SLOTS;
+	ctx->xfer_count--;
 }
 
-void mpsse_send_byte(uint8_t data)
+/* The time in us the MPSSE takes to run the commands of slot: the TCK
+ * cycles of the data shifts, TMS commands and MC_CLK_N/MC_CLK_N8, each at
+ * the divider in effect at that point of the buffer. */
+static uint64_t mpsse_clock_us(struct mpsse_ctx *ctx, const struct mpsse_xfer_slot *slot)
 {
-	int rc = ftdi_write_data(&mpsse_ftdic, &data, 1);
-	if (rc != 1) {
-		fprintf(stderr, "Write error (single byte, rc=%d, expected %d)(%s).\n", rc, 1, ftdi_get_error_string(&mpsse_ftdic));
-		mpsse_error(2);
+	const uint8_t *data = slot->data;
+	unsigned clkdiv = slot->clkdiv;
+	uint64_t cycles = 0;
+	double us = 0;
+
+	for (unsigned i = 0; i < slot->send_length; ) {
+		uint8_t cmd = data[i];
+
+		if (!(cmd & 0x80)) {
+			if (cmd & MC_DATA_BITS) {
+				cycles += data[i + 1] + 1;
+				i += cmd & (MC_DATA_OUT | MC_DATA_TMS) ? 3 : 2;
+			} else {
+				unsigned bytes = (data[i + 1] | data[i + 2] << 8) + 1;
+				cycles += bytes * 8;
+				i += 3 + (cmd & MC_DATA_OUT ? bytes : 0);
+			}
+			continue;
+		}
+
+		switch (cmd) {
+			case MC_SET_CLK_DIV:
+				us += cycles * 1e6 / mpsse_tck_hz(ctx, clkdiv);
+				cycles = 0;
+				clkdiv = (data[i + 1] | data[i + 2] << 8) + 1;
+				i += 3;
+				break;
+			case MC_CLK_N:
+				cycles += data[i + 1] + 1;
+				i += 2;
+				break;
+			case MC_CLK_N8:
+				cycles += ((data[i + 1] | data[i + 2] << 8) + 1) * 8;
+				i += 3;
+				break;
+			case MC_SETB_LOW:
+			case MC_SETB_HIGH:
+			case MC_CLK8_TO_H:
+			case MC_CLK8_TO_L:
+			case MC_TRI:
+				i += 3;
+				break;
+			default:
+				i += 1;
+				break;
+		}
 	}
+
+	return us + cycles * 1e6 / mpsse_tck_hz(ctx, clkdiv);
 }
 
+/* Hand the slot being filled over to the USB stack. */
+static void mpsse_xfer_submit(struct mpsse_ctx *ctx)
+{
+	struct mpsse_xfer_slot *slot = ctx->queue_slot;
+
+	/* Retiring older slots doesn't move the one being filled, it is always
+	 * the one following the last slot in flight. */
+	while (ctx->xfer_count && ctx->xfer_rx_pending + slot->receive_length > ctx->rx_fifo_size)
+		mpsse_xfer_retire(ctx);
+
+	/* Have the chip return the reply as soon as it is complete, instead of
+	 * holding a partial packet back until the latency timer expires. */
+	if (slot->receive_length)
+		slot->data[slot->send_length++] = MC_FLUSH;
+
+	slot->tc = ftdi_write_data_submit(ctx->ftdi, slot->data, slot->send_length);
+	if (slot->tc == NULL) {
+		fprintf(stderr, "Write submit error [%s]\n", ftdi_get_error_string(ctx->ftdi));
+		mpsse_error(ctx, 2);
+	}
+
+	/* The MPSSE starts on a buffer once it is done with the one before */
+	uint64_t now = mpsse_time_us();
+	if (ctx->xfer_done_us < now)
+		ctx->xfer_done_us = now;
+	ctx->xfer_done_us += mpsse_clock_us(ctx, slot);
+	slot->done_us = ctx->xfer_done_us;
+
+	ctx->xfer_rx_pending += slot->receive_length;
+	ctx->xfer_count++;
+	ctx->queue_slot = NULL;
+}
+
+/* Replies landing back to back in the same buffer share a segment */
+static bool mpsse_rx_contiguous(struct mpsse_xfer_slot *slot, uint8_t* receive_buffer)
+{
+	if (slot->segment_count == 0)
+		return false;
+
+	struct mpsse_rx_segment *last = &slot->segments[slot->segment_count - 1];
+	if (last->buffer == NULL || receive_buffer == NULL)
+		return last->buffer == receive_buffer;
+	return last->buffer + last->length == receive_buffer;
+}
 
-void mpsse_xfer(uint8_t* data_buffer, uint16_t send_length, uint16_t receive_length)
+uint8_t* mpsse_queue(struct mpsse_ctx *ctx, uint16_t send_length, uint8_t* receive_buffer, uint16_t receive_length)
 {
-	if(send_length){
-		int rc = ftdi_write_data(&mpsse_ftdic, data_buffer, send_length);
-		if (rc != send_length) {
-			fprintf(stderr, "Write error (rc=%d, expected %d)[%s]\n", rc, 1, ftdi_get_error_string(&mpsse_ftdic));
-			mpsse_error(2);
+	if (send_length > MPSSE_XFER_SIZE || receive_length > ctx->rx_fifo_size) {
+		fprintf(stderr, "Command too long (%u bytes, %u reply bytes)\n", send_length, receive_length);
+		mpsse_error(ctx, 2);
+	}
+
+	if (ctx->queue_slot != NULL) {
+		if (ctx->queue_slot->send_length + send_length > MPSSE_XFER_SIZE ||
+		    ctx->queue_slot->receive_length + receive_length > ctx->rx_fifo_size ||
+		    (receive_length && !mpsse_rx_contiguous(ctx->queue_slot, receive_buffer) &&
+		     ctx->queue_slot->segment_count == MPSSE_XFER_SEGMENTS))
+			mpsse_xfer_submit(ctx);
+	}
+
+	if (ctx->queue_slot == NULL) {
+		if (ctx->xfer_count == MPSSE_XFER_SLOTS)
+			mpsse_xfer_retire(ctx);
+
+		ctx->queue_slot = &ctx->slots[(ctx->xfer_head + ctx->xfer_count) % MPSSE_XFER_SLOTS];
+		ctx->queue_slot->send_length = 0;
+		ctx->queue_slot->receive_length = 0;
+		ctx->queue_slot->clkdiv = ctx->clkdiv;
+		ctx->queue_slot->segment_count = 0;
+	}
+
+	if (receive_length) {
+		if (mpsse_rx_contiguous(ctx->queue_slot, receive_buffer)) {
+			ctx->queue_slot->segments[ctx->queue_slot->segment_count - 1].length += receive_length;
+		} else {
+			struct mpsse_rx_segment *segment = &ctx->queue_slot->segments[ctx->queue_slot->segment_count++];
+			segment->buffer = receive_buffer;
+			segment->length = receive_length;
 		}
+		ctx->queue_slot->receive_length += receive_length;
 	}
 
-	if(receive_length){
-		/* Calls to ftdi_read_data may return with less data than requested if it wasn't ready. 
-		 * We stay in this while loop to collect all the data that we expect. */
-		uint16_t rx_len = 0;
-		while(rx_len != receive_length){
-			int rc = ftdi_read_data(&mpsse_ftdic, data_buffer + rx_len, receive_length - rx_len);
-			if (rc < 0) {
-				fprintf(stderr, "Read error (rc=%d)[%s]\n", rc, ftdi_get_error_string(&mpsse_ftdic));
-				mpsse_error(2);
-			}else{
-				rx_len += rc;
-			}
+	uint8_t *command = ctx->queue_slot->data + ctx->queue_slot->send_length;
+	ctx->queue_slot->send_length += send_length;
+	return command;
+}
+
+int mpsse_flush(struct mpsse_ctx *ctx)
+{
+	if (ctx->queue_slot != NULL)
+		mpsse_xfer_submit(ctx);
+
+	while (ctx->xfer_count)
+		mpsse_xfer_retire(ctx);
+
+	/* Report a timeout anywhere since the last flush, the pipeline has
+	 * already been reset so the caller is free to retry. */
+	int status = ctx->xfer_status;
+	ctx->xfer_status = MPSSE_OK;
+	return status;
+}
+
+/* Average round trip time of a one byte read, in microseconds */
+static unsigned mpsse_measure_rtt(struct mpsse_ctx *ctx)
+{
+	struct timeval start, end;
+	uint8_t data[1];
+
+	gettimeofday(&start, NULL);
+	for (int i = 0; i < 8; i++) {
+		data[0] = MC_READB_LOW;
+		mpsse_xfer(ctx, data, 1, 1);
+	}
+	gettimeofday(&end, NULL);
+
+	return ((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec)) / 8;
+}
+
+/* Every read is terminated by a Send Immediate, so the latency timer only
+ * decides how long the chip holds a partial packet back when nobody asked
+ * for it. Use the longest setting that doesn't slow down short transactions,
+ * bulk reads then come back in full 512 byte packets. */
+static void mpsse_tune_latency(struct mpsse_ctx *ctx)
+{
+	static const unsigned char candidates[] = { 16, 8, 4, 2 };
+	unsigned rtt_min = mpsse_measure_rtt(ctx);
+
+	for (int i = 0; i < sizeof(candidates); i++) {
+		if (ftdi_set_latency_timer(ctx->ftdi, candidates[i]) < 0)
+			continue;
+
+		/* A timer that still gates our reads costs whole milliseconds */
+		if (mpsse_measure_rtt(ctx) <= rtt_min + 250)
+			return;
+	}
+
+	if (ftdi_set_latency_timer(ctx->ftdi, 1) < 0) {
+		fprintf(stderr, "Failed to set latency timer (%s).\n", ftdi_get_error_string(ctx->ftdi));
+		mpsse_error(ctx, 2);
+	}
+}
+
+/* Match the transfer sizes to the chip we are talking to. A command buffer
+ * always goes out as one bulk OUT transfer, and the replies in flight are
+ * limited to what the channel's RX FIFO can hold, so the MPSSE never has to
+ * stop and wait for us to read. */
+static void mpsse_size_transfers(struct mpsse_ctx *ctx)
+{
+	static const struct mpsse_chip unknown = { TYPE_2232H, "unknown FTDI chip", 1024, 1024, 60000000, true };
+
+	ctx->chip = &unknown;
+	for (int i = 0; i < sizeof(mpsse_chips) / sizeof(mpsse_chips[0]); i++)
+		if (mpsse_chips[i].type == ctx->ftdi->type)
+			ctx->chip = &mpsse_chips[i];
+
+	ctx->rx_fifo_size = ctx->chip->rx_fifo_size;
+
+	/* Every USB packet from the chip starts with two modem status bytes, have
+	 * libftdi ask for a whole FIFO worth of replies in one request. */
+	unsigned packet_size = ctx->ftdi->max_packet_size;
+	unsigned read_packets = (ctx->rx_fifo_size + packet_size - 3) / (packet_size - 2);
+	unsigned write_packets = (MPSSE_XFER_SIZE + 1 + packet_size - 1) / packet_size;
+
+	if (ftdi_read_data_set_chunksize(ctx->ftdi, read_packets * packet_size) < 0 ||
+	    ftdi_write_data_set_chunksize(ctx->ftdi, write_packets * packet_size) < 0) {
+		fprintf(stderr, "Failed to set chunk size (%s).\n", ftdi_get_error_string(ctx->ftdi));
+		mpsse_error(ctx, 2);
+	}
+}
+
+unsigned mpsse_max_shift_bytes(struct mpsse_ctx *ctx)
+{
+	/* The three byte header of a data shift command shares the buffer */
+	unsigned max_bytes = MPSSE_XFER_SIZE - 3;
+	return max_bytes < ctx->rx_fifo_size ? max_bytes : ctx->rx_fifo_size;
+}
+
+const char *mpsse_chip_name(struct mpsse_ctx *ctx)
+{
+	return ctx->chip->name;
+}
+
+bool mpsse_has_clk_n(struct mpsse_ctx *ctx)
+{
+	return ctx->chip->clk_n;
+}
+
+void mpsse_set_clkdiv(struct mpsse_ctx *ctx, unsigned clkdiv)
+{
+	uint8_t data[3] = {
+		MC_SET_CLK_DIV,
+		(clkdiv-1) & 0xff,
+		(clkdiv-1) >> 8,
+	};
+	mpsse_xfer(ctx, data, 3, 0);
+	ctx->clkdiv = clkdiv;
+}
+
+unsigned mpsse_get_clkdiv(struct mpsse_ctx *ctx)
+{
+	return ctx->clkdiv;
+}
+
+unsigned mpsse_tck_hz(struct mpsse_ctx *ctx, unsigned clkdiv)
+{
+	return ctx->chip->master_clock / 2 / clkdiv;
+}
+
+int mpsse_find_devices(struct mpsse_device *devices, int max_devices)
+{
+	static const int product_ids[] = { 0x6010, 0x6011, 0x6014 };
+	int count = 0;
+
+	struct ftdi_context *ftdi = ftdi_new();
+	if (ftdi == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 0;
+	}
+
+	for (int i = 0; i < sizeof(product_ids) / sizeof(product_ids[0]); i++) {
+		struct ftdi_device_list *devlist;
+		if (ftdi_usb_find_all(ftdi, &devlist, 0x0403, product_ids[i]) < 0) {
+			fprintf(stderr, "Failed to list FTDI USB devices (%s).\n", ftdi_get_error_string(ftdi));
+			continue;
+		}
+
+		/* Serial numbers are only for display, they are not guaranteed to be
+		 * programmed or unique. The enumeration index identifies the device. */
+		int index = 0;
+		for (struct ftdi_device_list *dev = devlist; dev != NULL && count < max_devices; dev = dev->next, index++) {
+			struct mpsse_device *device = &devices[count++];
+			snprintf(device->devstr, sizeof(device->devstr), "i:0x0403:0x%04x:%d", product_ids[i], index);
+			device->serial[0] = '\0';
+			ftdi_usb_get_strings(ftdi, dev->dev, NULL, 0, NULL, 0, device->serial, sizeof(device->serial));
 		}
+
+		ftdi_list_free(&devlist);
 	}
+
+	ftdi_free(ftdi);
+	return count;
 }
 
-void mpsse_init(int ifnum, const char *devstr, int clkdiv)
+struct mpsse_ctx *mpsse_init(int ifnum, const char *devstr, int clkdiv)
 {
 	enum ftdi_interface ftdi_ifnum = INTERFACE_A;
 
+	struct mpsse_ctx *ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(2);
+	}
+	ctx->rx_fifo_size = MPSSE_RX_FIFO_SIZE;
+
 	switch (ifnum) {
 		case 0:
 			ftdi_ifnum = INTERFACE_A;
@@ -162,74 +609,93 @@ void mpsse_init(int ifnum, const char *devstr, int clkdiv)
 			break;
 	}
 
-	ftdi_init(&mpsse_ftdic);
-	ftdi_set_interface(&mpsse_ftdic, ftdi_ifnum);
+	ctx->ftdi = ftdi_new();
+	if (ctx->ftdi == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		free(ctx);
+		exit(2);
+	}
+	ftdi_set_interface(ctx->ftdi, ftdi_ifnum);
 
 	if (devstr != NULL) {
-		if (ftdi_usb_open_string(&mpsse_ftdic, devstr)) {
+		if (ftdi_usb_open_string(ctx->ftdi, devstr)) {
 			fprintf(stderr, "Can't find iCE FTDI USB device (device string %s).\n", devstr);
-			mpsse_error(2);
+			mpsse_error(ctx, 2);
 		}
 	} else {
-		if (ftdi_usb_open(&mpsse_ftdic, 0x0403, 0x6010) && ftdi_usb_open(&mpsse_ftdic, 0x0403, 0x6014)) {
-			fprintf(stderr, "Can't find iCE FTDI USB device (vendor_id 0x0403, device_id 0x6010 or 0x6014).\n");
-			mpsse_error(2);
+		if (ftdi_usb_open(ctx->ftdi, 0x0403, 0x6010) && ftdi_usb_open(ctx->ftdi, 0x0403, 0x6011) &&
+		    ftdi_usb_open(ctx->ftdi, 0x0403, 0x6014)) {
+			fprintf(stderr, "Can't find iCE FTDI USB device (vendor_id 0x0403, device_id 0x6010, 0x6011 or 0x6014).\n");
+			mpsse_error(ctx, 2);
 		}
 	}
 
-	mpsse_ftdic_open = true;
+	ctx->open = true;
+	ctx->clkdiv = clkdiv;
+	mpsse_size_transfers(ctx);
 
-	if (ftdi_usb_reset(&mpsse_ftdic)) {
+	if (ftdi_usb_reset(ctx->ftdi)) {
 		fprintf(stderr, "Failed to reset iCE FTDI USB device.\n");
-		mpsse_error(2);
+		mpsse_error(ctx, 2);
 	}
 
-	if (ftdi_usb_purge_buffers(&mpsse_ftdic)) {
+	if (ftdi_usb_purge_buffers(ctx->ftdi)) {
 		fprintf(stderr, "Failed to purge buffers on iCE FTDI USB device.\n");
-		mpsse_error(2);
+		mpsse_error(ctx, 2);
 	}
 
-	if (ftdi_get_latency_timer(&mpsse_ftdic, &mpsse_ftdi_latency) < 0) {
-		fprintf(stderr, "Failed to get latency timer (%s).\n", ftdi_get_error_string(&mpsse_ftdic));
-		mpsse_error(2);
+	if (ftdi_get_latency_timer(ctx->ftdi, &ctx->latency) < 0) {
+		fprintf(stderr, "Failed to get latency timer (%s).\n", ftdi_get_error_string(ctx->ftdi));
+		mpsse_error(ctx, 2);
 	}
 
 	/* 1 is the fastest polling, it means 1 kHz polling */
-	if (ftdi_set_latency_timer(&mpsse_ftdic, 1) < 0) {
-		fprintf(stderr, "Failed to set latency timer (%s).\n", ftdi_get_error_string(&mpsse_ftdic));
-		mpsse_error(2);
+	if (ftdi_set_latency_timer(ctx->ftdi, 1) < 0) {
+		fprintf(stderr, "Failed to set latency timer (%s).\n", ftdi_get_error_string(ctx->ftdi));
+		mpsse_error(ctx, 2);
 	}
 
-	mpsse_ftdic_latency_set = true;
+	ctx->latency_set = true;
 
 	/* Enter MPSSE (Multi-Protocol Synchronous Serial Engine) mode. Set all pins to output. */
-	if (ftdi_set_bitmode(&mpsse_ftdic, 0xff, BITMODE_MPSSE) < 0) {
+	if (ftdi_set_bitmode(ctx->ftdi, 0xff, BITMODE_MPSSE) < 0) {
 		fprintf(stderr, "Failed to set BITMODE_MPSSE on FTDI USB device.\n");
-		mpsse_error(2);
+		mpsse_error(ctx, 2);
 	}
 
-	int rc = ftdi_usb_purge_buffers(&mpsse_ftdic);
+	int rc = ftdi_usb_purge_buffers(ctx->ftdi);
 	if (rc != 0) {
 		fprintf(stderr, "Purge error.\n");
-		mpsse_error(2);
+		mpsse_error(ctx, 2);
 	}
 
-	mpsse_send_byte(MC_TCK_X5);
+	/* The FT2232D only has the 12MHz master clock, and rejects the command */
+	if (ctx->chip->master_clock == 60000000) {
+		uint8_t data[1] = { MC_TCK_X5 };
+		mpsse_xfer(ctx, data, 1, 0);
+	}
+
+	// set clock - actual clock is 30MHz/(clkdiv), 6MHz/(clkdiv) on the FT2232D
+	mpsse_set_clkdiv(ctx, clkdiv);
+
+	uint8_t setup[] = {
+		MC_SETB_LOW,
+		0x08, /* Value */
+		0x0B, /* Direction */
+	};
+	mpsse_xfer(ctx, setup, sizeof(setup), 0);
 
-        // set clock - actual clock is 6MHz/(clkdiv)
-        mpsse_send_byte(MC_SET_CLK_DIV);
-        mpsse_send_byte((clkdiv-1) & 0xff);
-        mpsse_send_byte((clkdiv-1) >> 8);
+	mpsse_tune_latency(ctx);
 
-	mpsse_send_byte(MC_SETB_LOW);
-	mpsse_send_byte(0x08); /* Value */
-	mpsse_send_byte(0x0B); /* Direction */
+	return ctx;
 }
 
-void mpsse_close(void)
+void mpsse_close(struct mpsse_ctx *ctx)
 {
-	ftdi_set_latency_timer(&mpsse_ftdic, mpsse_ftdi_latency);
-	ftdi_disable_bitbang(&mpsse_ftdic);
-	ftdi_usb_close(&mpsse_ftdic);
-	ftdi_deinit(&mpsse_ftdic);
+	mpsse_flush(ctx);
+	ftdi_set_latency_timer(ctx->ftdi, ctx->latency);
+	ftdi_disable_bitbang(ctx->ftdi);
+	ftdi_usb_close(ctx->ftdi);
+	ftdi_free(ctx->ftdi);
+	free(ctx);
 }
@@ -21,6 +21,7 @@
 #define MPSSE_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 
 
@@ -100,20 +101,43 @@ enum mpsse_cmd
 #define MC_DATA_OCN  (0x01) /* When set update data on negative clock edge */
 
 
-void mpsse_check_rx(void);
-void mpsse_error(int status);
-uint8_t mpsse_recv_byte(void);
-void mpsse_xfer(uint8_t* data_buffer, uint16_t send_length, uint16_t receive_length);
-void mpsse_send_byte(uint8_t data);
-void mpsse_send_spi(uint8_t *data, int n);
-void mpsse_xfer_spi(uint8_t *data, int n);
-uint8_t mpsse_xfer_spi_bits(uint8_t data, int n);
-void mpsse_set_gpio(uint8_t gpio, uint8_t direction);
-int mpsse_readb_low(void);
-int mpsse_readb_high(void);
-void mpsse_send_dummy_bytes(uint8_t n);
-void mpsse_send_dummy_bit(void);
-void mpsse_init(int ifnum, const char *devstr, int clkdiv);
-void mpsse_close(void);
+/* Command queue / asynchronous transfer engine sizing */
+#define MPSSE_XFER_SLOTS    4    /* Command buffers kept in flight */
+#define MPSSE_XFER_SIZE     4096 /* Size of each command buffer */
+#define MPSSE_XFER_SEGMENTS 64   /* Reply destinations per command buffer */
+#define MPSSE_RX_FIFO_SIZE  4096 /* Largest per channel RX FIFO (FT2232H) */
+#define MPSSE_TIMEOUT_MS    1000 /* Per transfer, on top of the time spent shifting */
+
+/* mpsse_flush() status */
+#define MPSSE_OK            0
+#define MPSSE_ERR_TIMEOUT   (-1)
+
+
+/* One MPSSE channel of an FTDI chip, see mpsse_init() */
+struct mpsse_ctx;
+
+/* An attached adapter, as found by mpsse_find_devices() */
+struct mpsse_device {
+	char devstr[32]; /* i:<vendor>:<product>:<index>, for mpsse_init() */
+	char serial[64];
+};
+
+void mpsse_error(struct mpsse_ctx *ctx, int status);
+void mpsse_set_thread_abort(bool enable);
+void mpsse_xfer(struct mpsse_ctx *ctx, uint8_t* data_buffer, uint16_t send_length, uint16_t receive_length);
+/* Appends a command to the outgoing buffer and returns where to write it.
+ * Its reply lands in receive_buffer once flushed, or is dropped if that is
+ * NULL. */
+uint8_t* mpsse_queue(struct mpsse_ctx *ctx, uint16_t send_length, uint8_t* receive_buffer, uint16_t receive_length);
+int mpsse_flush(struct mpsse_ctx *ctx);
+unsigned mpsse_max_shift_bytes(struct mpsse_ctx *ctx);
+const char *mpsse_chip_name(struct mpsse_ctx *ctx);
+bool mpsse_has_clk_n(struct mpsse_ctx *ctx);
+void mpsse_set_clkdiv(struct mpsse_ctx *ctx, unsigned clkdiv);
+unsigned mpsse_get_clkdiv(struct mpsse_ctx *ctx);
+unsigned mpsse_tck_hz(struct mpsse_ctx *ctx, unsigned clkdiv);
+int mpsse_find_devices(struct mpsse_device *devices, int max_devices);
+struct mpsse_ctx *mpsse_init(int ifnum, const char *devstr, int clkdiv);
+void mpsse_close(struct mpsse_ctx *ctx);
 
 #endif /* MPSSE_H */
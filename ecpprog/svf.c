@@ -0,0 +1,714 @@
+/*
+ * Playback of Serial Vector Format files through the JTAG layer.
+ *
+ * Supports SIR, SDR, HIR, HDR, TIR, TDR, ENDIR, ENDDR, RUNTEST, STATE,
+ * FREQUENCY and TRST. Scans with TDO data to compare have their results
+ * collected in batches of up to SVF_BATCH_SIZE bytes, which go out as a
+ * handful of large USB transfers and are checked once they are back.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "mpsse.h"
+#include "jtag.h"
+#include "svf.h"
+#include "bitvec.h"
+
+/* TDO data waiting to be checked, and what it is compared to */
+#define SVF_BATCH_SIZE (1024 * 1024)
+
+/* RUNTEST waits longer than this sleep on the host */
+#define SVF_HOST_WAIT_US 100000
+
+/* Parameters of SIR, SDR and their headers and trailers. They are sticky:
+ * a command that leaves out TDI or MASK reuses the previous value, unless
+ * the length changed. TDO is only compared if given with the command. */
+struct svf_scan {
+	uint32_t length;
+	uint8_t *tdi;
+	uint8_t *tdo;
+	uint8_t *mask;
+	bool check;
+};
+
+struct svf_player;
+
+/* A TDO comparison waiting for its batch to be flushed. The header, data
+ * and trailer parts of the scan each start on a byte of their own. */
+struct svf_check {
+	struct svf_player *svf;
+	int line;
+	uint32_t lengths[3];
+	size_t bytes;
+	uint8_t *actual;
+	uint8_t *expected;
+	uint8_t *mask;
+};
+
+struct svf_player {
+	struct jtag_ctx *jtag;
+	const char *filename;
+	int line;
+
+	struct svf_scan hir, sir, tir;
+	struct svf_scan hdr, sdr, tdr;
+	unsigned endir;
+	unsigned enddr;
+	unsigned run_state;
+	unsigned run_end_state;
+
+	/* Divider the session came with, FREQUENCY never goes faster */
+	unsigned clkdiv;
+	bool trst_warned;
+
+	/* Storage for the checks of the current batch */
+	uint8_t *batch;
+	size_t batch_size;
+	size_t batch_used;
+	int failed_line;
+
+	unsigned commands;
+	unsigned checks;
+	uint64_t scan_bits;
+	uint64_t clocks;
+};
+
+static const struct {
+	const char *name;
+	unsigned state;
+} svf_states[] = {
+	{ "RESET",     STATE_TEST_LOGIC_RESET },
+	{ "IDLE",      STATE_RUN_TEST_IDLE },
+	{ "DRSELECT",  STATE_SELECT_DR_SCAN },
+	{ "DRCAPTURE", STATE_CAPTURE_DR },
+	{ "DRSHIFT",   STATE_SHIFT_DR },
+	{ "DREXIT1",   STATE_EXIT1_DR },
+	{ "DRPAUSE",   STATE_PAUSE_DR },
+	{ "DREXIT2",   STATE_EXIT2_DR },
+	{ "DRUPDATE",  STATE_UPDATE_DR },
+	{ "IRSELECT",  STATE_SELECT_IR_SCAN },
+	{ "IRCAPTURE", STATE_CAPTURE_IR },
+	{ "IRSHIFT",   STATE_SHIFT_IR },
+	{ "IREXIT1",   STATE_EXIT1_IR },
+	{ "IRPAUSE",   STATE_PAUSE_IR },
+	{ "IREXIT2",   STATE_EXIT2_IR },
+	{ "IRUPDATE",  STATE_UPDATE_IR },
+};
+
+static int svf_error(struct svf_player *svf, const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "%s:%d: ", svf->filename, svf->line);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	return 1;
+}
+
+static double svf_time(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/* Returns the next word of a statement, or with *group set the contents of
+ * a (...) group with the white space squeezed out. NULL at the end. */
+static char *svf_token(char **p, bool *group)
+{
+	char *s = *p;
+
+	while (isspace((unsigned char)*s))
+		s++;
+	if (*s == '\0') {
+		*p = s;
+		return NULL;
+	}
+
+	char *start = s;
+	*group = (*s == '(');
+	if (*group) {
+		char *d = ++start;
+		for (s = start; *s != '\0' && *s != ')'; s++)
+			if (!isspace((unsigned char)*s))
+				*d++ = *s;
+		if (*s == ')')
+			s++;
+		*d = '\0';
+	} else {
+		while (*s != '\0' && !isspace((unsigned char)*s))
+			s++;
+		if (*s != '\0')
+			*s++ = '\0';
+	}
+
+	*p = s;
+	return start;
+}
+
+static bool svf_parse_state(const char *name, unsigned *state)
+{
+	for (int i = 0; i < sizeof(svf_states) / sizeof(svf_states[0]); i++) {
+		if (!strcasecmp(name, svf_states[i].name)) {
+			*state = svf_states[i].state;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool svf_stable_state(unsigned state)
+{
+	return state == STATE_TEST_LOGIC_RESET || state == STATE_RUN_TEST_IDLE ||
+	       state == STATE_PAUSE_DR || state == STATE_PAUSE_IR;
+}
+
+/* Hex strings hold the last bit shifted in the leftmost digit */
+static bool svf_parse_hex(const char *hex, uint8_t *data, uint32_t bits)
+{
+	size_t digits = strlen(hex);
+
+	memset(data, 0, (bits + 7) / 8);
+	for (size_t i = 0; i < digits; i++) {
+		char c = hex[digits - 1 - i];
+		if (!isxdigit((unsigned char)c))
+			return false;
+		if (i < (bits + 3) / 4) {
+			uint8_t v = isdigit((unsigned char)c) ? c - '0' : (tolower((unsigned char)c) - 'a' + 10);
+			data[i / 2] |= v << (i % 2 * 4);
+		}
+	}
+	if (bits % 8)
+		data[bits / 8] &= (1 << (bits % 8)) - 1;
+	return true;
+}
+
+/* Prints the parts of a scan like SVF writes them, the last bit first */
+static void svf_print_hex(const char *label, const struct svf_check *c, const uint8_t *data)
+{
+	size_t offsets[3] = { 0, (c->lengths[0] + 7) / 8, (c->lengths[0] + 7) / 8 + (c->lengths[1] + 7) / 8 };
+
+	fprintf(stderr, "  %-9s", label);
+	for (int part = 2; part >= 0; part--) {
+		if (c->lengths[part] == 0)
+			continue;
+		fprintf(stderr, " ");
+		for (int i = (c->lengths[part] + 3) / 4 - 1; i >= 0; i--)
+			fprintf(stderr, "%X", (data[offsets[part] + i / 2] >> (i % 2 * 4)) & 0xf);
+	}
+	fprintf(stderr, "\n");
+}
+
+/* Called by jtag_flush() once the TDO data of the scan has arrived */
+static void svf_check_tdo(void *arg)
+{
+	struct svf_check *c = arg;
+	struct svf_player *svf = c->svf;
+
+	svf->checks++;
+	if (svf->failed_line)
+		return;
+
+	long i = bitvec_mismatch(c->actual, c->expected, c->mask, c->bytes);
+	if (i >= 0) {
+		fprintf(stderr, "%s:%d: TDO mismatch\n", svf->filename, c->line);
+		if (c->lengths[0] + c->lengths[1] + c->lengths[2] <= 256) {
+			svf_print_hex("TDO", c, c->actual);
+			svf_print_hex("expected", c, c->expected);
+			svf_print_hex("mask", c, c->mask);
+		} else {
+			fprintf(stderr, "  first difference in byte %ld of %zu: 0x%02X, expected 0x%02X, mask 0x%02X\n",
+				i, c->bytes, c->actual[i], c->expected[i], c->mask[i]);
+		}
+		svf->failed_line = c->line;
+	}
+}
+
+/* Sends everything queued and runs the TDO checks of the batch */
+static int svf_flush(struct svf_player *svf)
+{
+	int status = jtag_flush(svf->jtag);
+	if (status != MPSSE_OK)
+		jtag_error(svf->jtag, 2);
+
+	svf->batch_used = 0;
+	return svf->failed_line ? 3 : 0;
+}
+
+static int svf_parse_scan(struct svf_player *svf, struct svf_scan *scan, char **p)
+{
+	bool group;
+	char *tok = svf_token(p, &group);
+	char *end;
+
+	if (tok == NULL || group)
+		return svf_error(svf, "scan length expected");
+	unsigned long length = strtoul(tok, &end, 10);
+	if (*end != '\0' || length > UINT32_MAX - 64)
+		return svf_error(svf, "`%s' is not a valid scan length", tok);
+
+	bool changed = (length != scan->length || scan->tdi == NULL);
+	if (changed) {
+		size_t bytes = length ? (length + 7) / 8 : 1;
+		scan->tdi = realloc(scan->tdi, bytes);
+		scan->tdo = realloc(scan->tdo, bytes);
+		scan->mask = realloc(scan->mask, bytes);
+		if (scan->tdi == NULL || scan->tdo == NULL || scan->mask == NULL)
+			return svf_error(svf, "out of memory");
+
+		memset(scan->tdi, 0, bytes);
+		memset(scan->tdo, 0, bytes);
+		memset(scan->mask, 0xff, bytes);
+		if (length % 8)
+			scan->mask[length / 8] &= (1 << (length % 8)) - 1;
+		scan->length = length;
+	}
+
+	bool have_tdi = false;
+	scan->check = false;
+
+	while ((tok = svf_token(p, &group)) != NULL) {
+		if (group)
+			return svf_error(svf, "unexpected value (%s)", tok);
+
+		char *keyword = tok;
+		char *hex = svf_token(p, &group);
+		if (hex == NULL || !group)
+			return svf_error(svf, "%s needs a (hex) value", keyword);
+
+		uint8_t *data;
+		if (!strcasecmp(keyword, "TDI")) {
+			data = scan->tdi;
+			have_tdi = true;
+		} else if (!strcasecmp(keyword, "TDO")) {
+			data = scan->tdo;
+			scan->check = true;
+		} else if (!strcasecmp(keyword, "MASK")) {
+			data = scan->mask;
+		} else if (!strcasecmp(keyword, "SMASK")) {
+			/* Only marks TDI bits as don't care, we send them as given */
+			continue;
+		} else {
+			return svf_error(svf, "unknown scan parameter `%s'", keyword);
+		}
+
+		if (!svf_parse_hex(hex, data, length))
+			return svf_error(svf, "`%s' is not a valid hex value", hex);
+	}
+
+	if (changed && !have_tdi && length > 0)
+		return svf_error(svf, "TDI is required when the scan length changes");
+
+	return 0;
+}
+
+static int svf_scan(struct svf_player *svf, bool ir)
+{
+	struct svf_scan *parts[3] = {
+		ir ? &svf->hir : &svf->hdr,
+		ir ? &svf->sir : &svf->sdr,
+		ir ? &svf->tir : &svf->tdr,
+	};
+
+	uint32_t total = parts[0]->length + parts[1]->length + parts[2]->length;
+	if (total == 0)
+		return 0;
+
+	/* The TDI data is shifted from where the parts keep it */
+	struct jtag_segment segments[3];
+	size_t bytes = 0;
+	for (int i = 0; i < 3; i++) {
+		segments[i].input = parts[i]->tdi;
+		segments[i].output = NULL;
+		segments[i].bits = parts[i]->length;
+		bytes += (parts[i]->length + 7) / 8;
+	}
+
+	/* Make room for the TDO data, expected data and mask of the scan */
+	struct svf_check *c = NULL;
+	if (parts[0]->check || parts[1]->check || parts[2]->check) {
+		size_t need = (sizeof(struct svf_check) + 3 * bytes + 7) & ~(size_t)7;
+
+		if (svf->batch_used + need > svf->batch_size) {
+			int rc = svf_flush(svf);
+			if (rc != 0)
+				return rc;
+		}
+		if (need > svf->batch_size) {
+			uint8_t *batch = realloc(svf->batch, need);
+			if (batch == NULL)
+				return svf_error(svf, "out of memory");
+			svf->batch = batch;
+			svf->batch_size = need;
+		}
+
+		c = (struct svf_check *)(svf->batch + svf->batch_used);
+		svf->batch_used += need;
+
+		c->svf = svf;
+		c->line = svf->line;
+		c->bytes = bytes;
+		c->actual = (uint8_t *)(c + 1);
+		c->expected = c->actual + bytes;
+		c->mask = c->expected + bytes;
+
+		size_t offset = 0;
+		for (int i = 0; i < 3; i++) {
+			size_t part_bytes = (parts[i]->length + 7) / 8;
+			c->lengths[i] = parts[i]->length;
+			segments[i].output = c->actual + offset;
+			if (parts[i]->check) {
+				memcpy(c->expected + offset, parts[i]->tdo, part_bytes);
+				memcpy(c->mask + offset, parts[i]->mask, part_bytes);
+				if (parts[i]->length % 8)
+					c->mask[offset + part_bytes - 1] &= (1 << (parts[i]->length % 8)) - 1;
+			} else {
+				memset(c->expected + offset, 0, part_bytes);
+				memset(c->mask + offset, 0, part_bytes);
+			}
+			offset += part_bytes;
+		}
+	}
+
+	/* Through CAPTURE, a scan started from a PAUSE state must not go
+	 * straight back to SHIFT. */
+	jtag_go_to_state(svf->jtag, ir ? STATE_CAPTURE_IR : STATE_CAPTURE_DR);
+	jtag_go_to_state(svf->jtag, ir ? STATE_SHIFT_IR : STATE_SHIFT_DR);
+	jtag_queue_segments(svf->jtag, segments, 3, true);
+	jtag_go_to_state(svf->jtag, ir ? svf->endir : svf->enddr);
+
+	if (c != NULL)
+		jtag_queue_callback(svf->jtag, svf_check_tdo, c);
+
+	svf->scan_bits += total;
+	svf->clocks += total;
+	return 0;
+}
+
+static int svf_runtest(struct svf_player *svf, char **p)
+{
+	bool group;
+	char *tok = svf_token(p, &group);
+	unsigned state;
+	uint64_t count = 0;
+	double min_time = 0;
+	bool run_given = false;
+	bool end_given = false;
+
+	if (tok != NULL && !group && svf_parse_state(tok, &state)) {
+		if (!svf_stable_state(state))
+			return svf_error(svf, "RUNTEST needs a stable run state, not %s", tok);
+		svf->run_state = state;
+		run_given = true;
+		tok = svf_token(p, &group);
+	}
+
+	for (; tok != NULL; tok = svf_token(p, &group)) {
+		if (group)
+			return svf_error(svf, "unexpected value (%s)", tok);
+
+		if (!strcasecmp(tok, "ENDSTATE")) {
+			tok = svf_token(p, &group);
+			if (tok == NULL || group || !svf_parse_state(tok, &state) || !svf_stable_state(state))
+				return svf_error(svf, "ENDSTATE needs a stable state");
+			svf->run_end_state = state;
+			end_given = true;
+			continue;
+		}
+
+		bool maximum = !strcasecmp(tok, "MAXIMUM");
+		if (maximum && (tok = svf_token(p, &group)) == NULL)
+			return svf_error(svf, "MAXIMUM needs a time");
+
+		char *end;
+		double value = strtod(tok, &end);
+		char *unit = svf_token(p, &group);
+		if (*end != '\0' || value < 0 || unit == NULL || group)
+			return svf_error(svf, "RUNTEST: `%s' is not a valid count or time", tok);
+
+		if (maximum)
+			continue;
+		if (!strcasecmp(unit, "TCK") || !strcasecmp(unit, "SCK"))
+			count = (uint64_t)value;
+		else if (!strcasecmp(unit, "SEC"))
+			min_time = value;
+		else
+			return svf_error(svf, "RUNTEST: unknown unit `%s'", unit);
+	}
+
+	/* A run state without ENDSTATE ends there too, otherwise the last
+	 * ENDSTATE still holds */
+	if (run_given && !end_given)
+		svf->run_end_state = svf->run_state;
+
+	jtag_go_to_state(svf->jtag, svf->run_state);
+
+	/* Short waits are timed with TCK cycles in the stream. A long one is
+	 * slept on the host after the cycles asked for, with TCK stopped in
+	 * the run state, instead of holding up everything queued after it. */
+	uint64_t time_count = (uint64_t)(min_time * jtag_tck_hz(svf->jtag, JTAG_PHASE_CONTROL) + 0.999);
+	if (time_count > count && min_time * 1e6 > SVF_HOST_WAIT_US) {
+		jtag_run_clocks(svf->jtag, count);
+		int rc = svf_flush(svf);
+		if (rc != 0)
+			return rc;
+		usleep(min_time * 1e6);
+	} else {
+		if (time_count > count)
+			count = time_count;
+		jtag_run_clocks(svf->jtag, count);
+	}
+
+	jtag_go_to_state(svf->jtag, svf->run_end_state);
+
+	svf->clocks += count;
+	return 0;
+}
+
+static int svf_state(struct svf_player *svf, char **p)
+{
+	bool group;
+	char *tok;
+	unsigned state = STATE_RUN_TEST_IDLE;
+	bool any = false;
+
+	while ((tok = svf_token(p, &group)) != NULL) {
+		if (group || !svf_parse_state(tok, &state))
+			return svf_error(svf, "STATE: `%s' is not a TAP state", tok);
+		jtag_go_to_state(svf->jtag, state);
+		any = true;
+	}
+
+	if (!any || !svf_stable_state(state))
+		return svf_error(svf, "STATE must end in a stable state");
+	return 0;
+}
+
+static int svf_end_state(struct svf_player *svf, char **p, unsigned *end_state)
+{
+	bool group;
+	char *tok = svf_token(p, &group);
+	unsigned state;
+
+	if (tok == NULL || group || !svf_parse_state(tok, &state) || !svf_stable_state(state))
+		return svf_error(svf, "a stable end state is required");
+	*end_state = state;
+	return 0;
+}
+
+static int svf_frequency(struct svf_player *svf, char **p)
+{
+	bool group;
+	char *tok = svf_token(p, &group);
+	unsigned clkdiv = svf->clkdiv;
+
+	if (tok != NULL) {
+		char *end;
+		double hz = strtod(tok, &end);
+		char *unit = svf_token(p, &group);
+		if (group || *end != '\0' || hz <= 0 || unit == NULL || strcasecmp(unit, "HZ"))
+			return svf_error(svf, "FREQUENCY: `%s' is not a valid frequency", tok);
+
+		/* TCK is base / clkdiv, pick the fastest clock not above hz */
+		double base = (double)jtag_tck_hz(svf->jtag, JTAG_PHASE_CONTROL) * jtag_get_clkdiv(svf->jtag, JTAG_PHASE_CONTROL);
+		double div = base / hz;
+		clkdiv = div > 65536 ? 65536 : (unsigned)div;
+		if (clkdiv < div)
+			clkdiv++;
+		if (clkdiv < svf->clkdiv)
+			clkdiv = svf->clkdiv;
+	}
+
+	if (clkdiv != jtag_get_clkdiv(svf->jtag, JTAG_PHASE_CONTROL))
+		jtag_set_clkdiv(svf->jtag, JTAG_PHASE_CONTROL, clkdiv);
+	return 0;
+}
+
+static int svf_command(struct svf_player *svf, char *statement)
+{
+	char *p = statement;
+	bool group;
+	char *cmd = svf_token(&p, &group);
+
+	if (cmd == NULL)
+		return 0;
+	if (group)
+		return svf_error(svf, "command expected");
+
+	svf->commands++;
+
+	int rc;
+	if (!strcasecmp(cmd, "SIR")) {
+		rc = svf_parse_scan(svf, &svf->sir, &p);
+		return rc ? rc : svf_scan(svf, true);
+	} else if (!strcasecmp(cmd, "SDR")) {
+		rc = svf_parse_scan(svf, &svf->sdr, &p);
+		return rc ? rc : svf_scan(svf, false);
+	} else if (!strcasecmp(cmd, "HIR")) {
+		return svf_parse_scan(svf, &svf->hir, &p);
+	} else if (!strcasecmp(cmd, "TIR")) {
+		return svf_parse_scan(svf, &svf->tir, &p);
+	} else if (!strcasecmp(cmd, "HDR")) {
+		return svf_parse_scan(svf, &svf->hdr, &p);
+	} else if (!strcasecmp(cmd, "TDR")) {
+		return svf_parse_scan(svf, &svf->tdr, &p);
+	} else if (!strcasecmp(cmd, "ENDIR")) {
+		return svf_end_state(svf, &p, &svf->endir);
+	} else if (!strcasecmp(cmd, "ENDDR")) {
+		return svf_end_state(svf, &p, &svf->enddr);
+	} else if (!strcasecmp(cmd, "RUNTEST")) {
+		return svf_runtest(svf, &p);
+	} else if (!strcasecmp(cmd, "STATE")) {
+		return svf_state(svf, &p);
+	} else if (!strcasecmp(cmd, "FREQUENCY")) {
+		return svf_frequency(svf, &p);
+	} else if (!strcasecmp(cmd, "TRST")) {
+		/* There is no TRST pin, the TAP is reset with TMS instead */
+		char *mode = svf_token(&p, &group);
+		if (mode != NULL && !strcasecmp(mode, "ON") && !svf->trst_warned) {
+			fprintf(stderr, "%s:%d: TRST is not connected, ignored\n", svf->filename, svf->line);
+			svf->trst_warned = true;
+		}
+		return 0;
+	}
+
+	return svf_error(svf, "unsupported command `%s'", cmd);
+}
+
+static void svf_free_scan(struct svf_scan *scan)
+{
+	free(scan->tdi);
+	free(scan->tdo);
+	free(scan->mask);
+}
+
+int svf_play(struct jtag_ctx *jtag, FILE *f, const char *filename)
+{
+	/* Read the whole file, statements may span any number of lines */
+	char *text = NULL;
+	size_t text_len = 0, text_alloc = 0;
+	while (true) {
+		if (text_len + 1 >= text_alloc) {
+			text_alloc = text_alloc ? text_alloc * 2 : 1024 * 1024;
+			char *t = realloc(text, text_alloc);
+			if (t == NULL) {
+				fprintf(stderr, "Out of memory.\n");
+				free(text);
+				return 1;
+			}
+			text = t;
+		}
+		size_t rc = fread(text + text_len, 1, text_alloc - text_len - 1, f);
+		if (rc == 0)
+			break;
+		text_len += rc;
+	}
+	if (ferror(f)) {
+		fprintf(stderr, "%s: read error\n", filename);
+		free(text);
+		return 1;
+	}
+	text[text_len] = '\0';
+
+	struct svf_player *svf = calloc(1, sizeof(*svf));
+	char *statement = malloc(3 * text_len + 1);
+	uint8_t *batch = malloc(SVF_BATCH_SIZE);
+	if (svf == NULL || statement == NULL || batch == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		free(text);
+		free(svf);
+		free(statement);
+		free(batch);
+		return 1;
+	}
+
+	svf->jtag = jtag;
+	svf->filename = filename;
+	svf->endir = STATE_RUN_TEST_IDLE;
+	svf->enddr = STATE_RUN_TEST_IDLE;
+	svf->run_state = STATE_RUN_TEST_IDLE;
+	svf->run_end_state = STATE_RUN_TEST_IDLE;
+	svf->clkdiv = jtag_get_clkdiv(jtag, JTAG_PHASE_CONTROL);
+	svf->batch = batch;
+	svf->batch_size = SVF_BATCH_SIZE;
+
+	double start = svf_time();
+	int rc = 0;
+	int line = 1;
+	size_t len = 0;
+
+	/* Split into statements, with comments dropped and parentheses padded
+	 * with spaces, and run each as soon as its ';' is found. */
+	for (size_t i = 0; i < text_len && rc == 0; i++) {
+		char c = text[i];
+
+		if (c == '!' || (c == '/' && text[i + 1] == '/')) {
+			while (i + 1 < text_len && text[i + 1] != '\n')
+				i++;
+			continue;
+		}
+
+		if (c == '\n')
+			line++;
+
+		if (c == ';') {
+			statement[len] = '\0';
+			rc = svf_command(svf, statement);
+			len = 0;
+			continue;
+		}
+
+		if (len == 0) {
+			if (isspace((unsigned char)c))
+				continue;
+			svf->line = line;
+		}
+		if (c == '(' || c == ')') {
+			statement[len++] = ' ';
+			statement[len++] = c;
+			statement[len++] = ' ';
+		} else {
+			statement[len++] = isspace((unsigned char)c) ? ' ' : c;
+		}
+	}
+
+	if (rc == 0 && len > 0)
+		rc = svf_error(svf, "missing `;' at the end of the file");
+
+	if (rc == 0)
+		rc = svf_flush(svf);
+	else
+		jtag_flush(jtag);
+
+	double seconds = svf_time() - start;
+	jtag_set_clkdiv(jtag, JTAG_PHASE_CONTROL, svf->clkdiv);
+
+	fprintf(stderr, "SVF: %u commands, %u TDO checks, %.1f kbit shifted, %llu TCK cycles in %.2f s (%.1f kbit/s)\n",
+		svf->commands, svf->checks, svf->scan_bits / 1e3, (unsigned long long)svf->clocks,
+		seconds, seconds > 0 ? svf->scan_bits / 1e3 / seconds : 0);
+
+	svf_free_scan(&svf->hir);
+	svf_free_scan(&svf->sir);
+	svf_free_scan(&svf->tir);
+	svf_free_scan(&svf->hdr);
+	svf_free_scan(&svf->sdr);
+	svf_free_scan(&svf->tdr);
+	free(svf->batch);
+	free(svf);
+	free(statement);
+	free(text);
+	return rc;
+}
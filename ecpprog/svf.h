@@ -0,0 +1,24 @@
+/*
+ * Playback of Serial Vector Format files through the JTAG layer.
+ *
+ * Scans are queued and sent in large batches; their TDO data is compared
+ * against the expected values once each batch has been flushed, so a
+ * mismatch is reported with its line number, but only after the commands
+ * following it in the same batch have been executed as well.
+ */
+
+#ifndef __SVF_H__
+#define __SVF_H__
+
+#include <stdio.h>
+
+struct jtag_ctx;
+
+/**
+ * Plays back the SVF file f. filename is only used in messages.
+ * Returns 0 on success, 1 if the file could not be read or parsed, and
+ * 3 if the TDO data read back did not match.
+ */
+int svf_play(struct jtag_ctx *jtag, FILE *f, const char *filename);
+
+#endif